@@ -0,0 +1,222 @@
+// keyword highlighting benchmark: linear substr scan render2hl used to run vs grammar with perfect hash
+// usage: keywords [file] [passes], file defaults to mim.cpp
+
+#define main mim_main
+#include "../mim.cpp"
+#undef main
+
+/*** linear substr scan (render2hl before keyword table) ***/
+
+class LinearHighlighter {
+    public:
+        LinearHighlighter(void) {
+            string _keywords_type[] = {
+                "int", "long", "double", "float", "bool",
+                "char", "string", "unsigned", "signed", "void"
+            };
+            string _keywords_statement[] = {
+                "switch", "if", "while", "for", "break", "continue", "return", "else",
+                "struct", "union", "typedef", "static", "enum", "class", "case", "include", "#include"
+            };
+            this->keywords_type = vector<string>(_keywords_type, _keywords_type + sizeof(_keywords_type) / sizeof(_keywords_type[0]));
+            this->keywords_statement = vector<string>(_keywords_statement, _keywords_statement + sizeof(_keywords_statement) / sizeof(_keywords_statement[0]));
+        }
+
+        // in_comment carries open /* */ from row to row
+        const string render2hl(const string &render, bool &in_comment) {
+            string hl = "";
+            bool prev_sep = true;
+            int in_string = 0;
+
+            for (int i = 0, len = (int)render.length(); i < len; ++i) {
+                char ch = render[i];
+                char prev_hl = (i > 0) ? hl[i - 1] : (char)Mim::HL::plain;
+
+                if (!in_string && !in_comment) {
+                    if (render.substr(i, 2) == "//") {
+                        hl += string(len - i, Mim::HL::comment);
+                        break;
+                    }
+                }
+
+                if (!in_string) {
+                    if (in_comment) {
+                        hl += Mim::HL::mlcomment;
+
+                        if (render.substr(i, 2) == "*/") {
+                            hl += Mim::HL::mlcomment;
+                            in_comment = false;
+                            prev_sep = true;
+                            ++i;
+                        }
+
+                        continue;
+                    } else if (render.substr(i, 2) == "/*") {
+                        hl += string(2, Mim::HL::mlcomment);
+                        in_comment = true;
+                        ++i;
+                        continue;
+                    }
+                }
+
+                if (in_string) {
+                    hl += Mim::HL::str;
+
+                    if (ch == '\\' && (i + 1) < len) {
+                        hl += Mim::HL::str;
+                        ++i;
+                    } else {
+                        if (ch == in_string) {
+                            in_string = 0;
+                        }
+
+                        prev_sep = true;
+                    }
+                } else if (ch == '"' || ch == '\'') {
+                    hl += Mim::HL::str;
+                    in_string = ch;
+                } else if ((isdigit(ch) && (prev_sep || prev_hl == Mim::HL::number))
+                        || (ch == '.' && prev_hl == Mim::HL::number)) {
+                    hl += Mim::HL::number;
+                    prev_sep = false;
+                } else if (prev_sep) {
+                    bool is_keyword = false;
+
+                    for (int j = 0, size = (int)this->keywords_type.size(); j < size; ++j) {
+                        int len = (int)this->keywords_type[j].length();
+
+                        if (render.substr(i, len) == this->keywords_type[j]
+                                && this->isSeparator(render[i + len])) {
+                            is_keyword = true;
+                            hl += string(len, Mim::HL::keyword_type);
+                            i += (len - 1);
+                            break;
+                        }
+                    }
+
+                    if (!is_keyword) {
+                        for (int j = 0, size = (int)this->keywords_statement.size(); j < size; ++j) {
+                            int len = (int)this->keywords_statement[j].length();
+
+                            if (render.substr(i, len) == this->keywords_statement[j]
+                                    && this->isSeparator(render[i + len])) {
+                                is_keyword = true;
+                                hl += string(len, Mim::HL::keyword_statement);
+                                i += (len - 1);
+                                break;
+                            }
+                        }
+                    }
+
+                    if (is_keyword) {
+                        prev_sep = false;
+                    } else {
+                        if (this->isSeparator(ch)){
+                            hl += Mim::HL::comment;
+                        } else {
+                            hl += Mim::HL::plain;
+                        }
+
+                        prev_sep = this->isSeparator(ch);
+                    }
+                } else {
+                    if (this->isSeparator(ch)){
+                        hl += Mim::HL::comment;
+                    } else {
+                        hl += Mim::HL::plain;
+                    }
+
+                    prev_sep = this->isSeparator(ch);
+                }
+            }
+
+            return hl;
+        }
+
+    private:
+        vector<string> keywords_type;
+        vector<string> keywords_statement;
+
+        bool isSeparator(int ch) {
+            return isspace(ch) || ch == '\0' || strchr(",.()+-/*=~%<>[];{}", ch) != NULL;
+        }
+};
+
+/*** driver ***/
+
+static double elapsedNs(chrono::steady_clock::time_point start) {
+    return (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv) {
+    const char *filename = (argc > 1) ? argv[1] : "mim.cpp";
+    int passes = (argc > 2) ? atoi(argv[2]) : 50;
+    FILE *fp = fopen(filename, "r");
+
+    if (fp == NULL) {
+        perror(filename);
+        return 1;
+    }
+
+    vector<string> rows;
+    size_t bytes = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t length;
+
+    while ((length = getline(&line, &cap, fp)) != -1) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            --length;
+        }
+
+        rows.push_back(string(line, length));
+        bytes += length;
+    }
+
+    free(line);
+    fclose(fp);
+
+    if (bytes == 0 || passes <= 0) {
+        fprintf(stderr, "nothing to highlight\n");
+        return 1;
+    }
+
+    // sums of colors keep either loop from being optimized away
+    LinearHighlighter linear;
+    size_t linear_sum = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    for (int pass = 0; pass < passes; ++pass) {
+        bool in_comment = false;
+
+        for (const string &row : rows) {
+            string hl = linear.render2hl(row, in_comment);
+            linear_sum += hl.empty() ? 0 : (unsigned char)hl[hl.length() / 2];
+        }
+    }
+
+    double linear_ns = elapsedNs(start);
+
+    size_t table_sum = 0;
+    start = chrono::steady_clock::now();
+
+    for (int pass = 0; pass < passes; ++pass) {
+        unsigned char state = 0;
+
+        for (const string &row : rows) {
+            string hl(row.length(), Mim::HL::plain);
+            state = c_grammar.highlight(row.data(), row.length(), state, &hl[0]);
+            table_sum += hl.empty() ? 0 : (unsigned char)hl[hl.length() / 2];
+        }
+    }
+
+    double table_ns = elapsedNs(start);
+    double total = (double)bytes * passes;
+
+    printf("%s: %zu rows, %zu bytes, %d passes (checksums %zu %zu)\n",
+            filename, rows.size(), bytes, passes, linear_sum, table_sum);
+    printf("  linear substr scan      %8.2f ns/byte\n", linear_ns / total);
+    printf("  grammar + keyword table %8.2f ns/byte (%.1fx)\n", table_ns / total, linear_ns / table_ns);
+
+    return 0;
+}
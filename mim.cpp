@@ -1,17 +1,44 @@
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <fcntl.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <vector>
+#include <map>
+#include <list>
+#include <deque>
 #include <string>
-#include <fstream>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <iterator>
 #include <stdexcept>
 #include <regex>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define MIM_X86_SIMD
+#endif
+
 using namespace std;
 
 /*** keypad macros ***/
@@ -28,7 +55,8 @@ enum EditorKey {
     KEY_HOME,
     KEY_END,
     KEY_PAGE_UP,
-    KEY_PAGE_DOWN
+    KEY_PAGE_DOWN,
+    KEY_PASTE       // bracketed paste, text in paste buffer
 };
 
 /*** VT100 control sequences macros ***/
@@ -56,6 +84,10 @@ struct MimConfig {
     int screen_cols;
     int tabs_width;
     bool set_num;
+    int prefetch_rows;  // rows rendered above and below screen
+    size_t cache_size;  // memory budget of rendered rows (bytes)
+    size_t undo_size;   // memory budget of undo history (bytes)
+    bool search_count;  // count matches of search (match i/N in status bar)
     bool verbose;
     struct termios orig_termios;
 };
@@ -80,500 +112,3742 @@ struct CursorPosition {
     }
 };
 
+// raw offset of a tab and render column after it, columns between tabs map one to one
+struct TabStop {
+    int cx;
+    int rx;
+};
+
+// materialized row of text buffer (cached for drawing)
 struct RowBuffer {
     string raw;
     string render;
     string hl; // highlight config for render string
-    bool hl_open_comment;
+    vector<TabStop> tabs;   // every tab of raw, maps columns without walking raw
 
     RowBuffer(void) {
         this->raw = "";
         this->render = this->raw;
         this->hl = "";
-        this->hl_open_comment = false;
-    }
-
-    RowBuffer(const RowBuffer &buf) {
-        this->raw = buf.raw;
-        this->render = buf.render;
-        this->hl = buf.hl;
-        this->hl_open_comment = buf.hl_open_comment;
     }
 
     RowBuffer(const string &raw) {
         this->raw = raw;
         this->render = this->raw;
         this->hl = "";
-        this->hl_open_comment = false;
     }
 };
 
-class Mim {
+// lexer checkpoint of a row, row is lexed again only if its start state changed
+struct LineState {
+    unsigned char start;    // grammar state at start of row (when lexed)
+    unsigned char end;      // grammar state at start of next row
+    bool lexed;             // false for new rows
+
+    LineState(void) {
+        this->start = 0;
+        this->end = 0;
+        this->lexed = false;
+    }
+
+    LineState(unsigned char start, unsigned char end) {
+        this->start = start;
+        this->end = end;
+        this->lexed = true;
+    }
+};
+
+// lexer checkpoints of all rows, in chunks of a treap keyed by row count:
+// rows are inserted and erased in O(log n) (plus one chunk), rows after them are not moved
+class LineStates {
     public:
-        Mim(void) {
-            this->config.tabs_width = 4;
-            this->config.set_num = true;
-            this->config.verbose = true;
+        LineStates(void) {
+            this->seed = 2463534242u;
         }
 
-        Mim(const Mim &mim) {
-            this->set_config(mim.get_config());
+        size_t size(void) const {
+            return LineStates::sizeOf(this->root);
         }
 
-        Mim(const MimConfig &config) {
-            this->set_config(config);
+        void clear(void) {
+            this->root.reset();
         }
 
-        ~Mim(void) {
-            try {
-                this->disableRawMode();
+        // lines new rows
+        void assign(size_t lines) {
+            this->clear();
+            this->insert(0, lines);
+        }
 
-                if (this->config.verbose) {
-                    fprintf(log, "=> Exit...\r\n");
-                    fclose(log);
+        LineState &operator[](size_t row) {
+            Node *t = this->locate(row, 0);
+            return t->rows[row];
+        }
+
+        // lines new rows before row
+        void insert(size_t row, size_t lines) {
+            if (lines == 0) {
+                return;
+            }
+
+            if (this->root && lines <= LineStates::chunk_size) {
+                size_t at = row;
+                Node *t = this->locate(at, (long)lines);
+                t->rows.insert(t->rows.begin() + at, lines, LineState());
+
+                // halve chunk grown too big
+                if (t->rows.size() > 2 * LineStates::chunk_size) {
+                    NodePtr left, chunk, right;
+                    size_t length = t->rows.size();
+                    this->split(move(this->root), row - at, left, chunk);
+                    this->split(move(chunk), length, chunk, right);
+
+                    NodePtr tail = this->makeNode(length / 2);
+                    copy(chunk->rows.begin() + length - length / 2, chunk->rows.end(), tail->rows.begin());
+                    chunk->rows.resize(length - length / 2);
+                    chunk->size = chunk->rows.size();
+
+                    chunk = LineStates::merge(move(chunk), move(tail));
+                    this->root = LineStates::merge(LineStates::merge(move(left), move(chunk)), move(right));
                 }
-            } catch (const MimError &e) {
-                printf("%s\r\n", e.what());
+
+                return;
+            }
+
+            NodePtr left, right, added;
+            this->split(move(this->root), row, left, right);
+
+            for (size_t done = 0; done < lines; done += LineStates::chunk_size) {
+                added = LineStates::merge(move(added), this->makeNode(min(lines - done, (size_t)LineStates::chunk_size)));
             }
+
+            this->root = LineStates::merge(LineStates::merge(move(left), move(added)), move(right));
         }
 
-        void init(void) {
-            try {
-                this->editor_state = Mim::MimState::stoped;
-                this->editor_mode = Mim::MimMode::command;
-                this->cx = 0;
-                this->cy = 0;
-                this->rx = 0;
-                this->rx_base = 0;
-                this->row_off = 0;
-                this->col_off = 0;
-                this->num_rows = 0;
-                this->rows_buffer.clear();
-                this->screen_buffer.clear();
-                this->command_buffer.clear();
-                this->dirty_flag = false;
-                this->force_quit = false;
-                this->last_search_row = 0;
-                this->last_search_buffer = "";
-                this->last_search_hl = "";
-
-                string _keywords_type[] = {
-                    "int", "long", "double", "float", "bool",
-                    "char", "string", "unsigned", "signed", "void"
-                };
-                string _keywords_statement[] = {
-                    "switch", "if", "while", "for", "break", "continue", "return", "else",
-                    "struct", "union", "typedef", "static", "enum", "class", "case", "include", "#include"
-                };
-                this->keywords_type = vector<string>(_keywords_type, _keywords_type + sizeof(_keywords_type) / sizeof(_keywords_type[0]));
-                this->keywords_statement = vector<string>(_keywords_statement, _keywords_statement + sizeof(_keywords_statement) / sizeof(_keywords_statement[0]));
+        void erase(size_t row, size_t lines) {
+            if (lines == 0 || !this->root) {
+                return;
+            }
 
-                this->updateLastlineBuffer("");
-                this->editor_filename = "";
+            // inside one chunk (not all of it)
+            size_t at = row;
+            Node *t = this->locate(at, 0);
 
-                this->enableRawMode();
+            if (at + lines <= t->rows.size() && lines < t->rows.size()) {
+                at = row;
+                t = this->locate(at, -(long)lines);
+                t->rows.erase(t->rows.begin() + at, t->rows.begin() + at + lines);
+                return;
+            }
 
-                struct winsize ws = this->getWindowSize();
-                this->config.screen_rows = ws.ws_row - 2;   // reserve two lines for status bar and lastline mode
-                this->config.screen_cols = ws.ws_col;
+            NodePtr left, erased, right;
+            this->split(move(this->root), row, left, erased);
+            this->split(move(erased), lines, erased, right);
+            this->root = LineStates::merge(move(left), move(right));
+        }
 
-                if (this->config.verbose) {
-                    log = fopen(".log", "w+");
+    private:
+        struct Node;
+        typedef unique_ptr<Node> NodePtr;
+
+        struct Node {
+            vector<LineState> rows;
+            unsigned int priority;
+            size_t size;    // rows in subtree
+            NodePtr left;
+            NodePtr right;
+        };
 
-                    if (log == NULL) {
-                        throw MimError("Open log file failed.");
-                    }
+        NodePtr root;
+        unsigned int seed;
+        static const size_t chunk_size = 512;   // rows of chunk made at once, halved over twice as many
 
-                    fprintf(log, "=> Init...\r\n");
+        static size_t sizeOf(const NodePtr &t) {
+            return t ? t->size : 0;
+        }
+
+        static void update(Node *t) {
+            t->size = t->rows.size() + LineStates::sizeOf(t->left) + LineStates::sizeOf(t->right);
+        }
+
+        unsigned int random(void) {
+            // xorshift32
+            this->seed ^= this->seed << 13;
+            this->seed ^= this->seed >> 17;
+            this->seed ^= this->seed << 5;
+            return this->seed;
+        }
+
+        NodePtr makeNode(size_t lines) {
+            NodePtr t(new Node());
+            t->rows.assign(lines, LineState());
+            t->priority = this->random();
+            t->size = lines;
+            return t;
+        }
+
+        // chunk holding row (or ending at it), row becomes index in chunk; sizes on path change by delta
+        Node *locate(size_t &row, long delta) {
+            Node *t = this->root.get();
+
+            while (true) {
+                size_t left = LineStates::sizeOf(t->left);
+                t->size += delta;
+
+                if (row < left) {
+                    t = t->left.get();
+                } else if (row - left < t->rows.size() || (row - left == t->rows.size() && !t->right)) {
+                    row -= left;
+                    return t;
+                } else {
+                    row -= left + t->rows.size();
+                    t = t->right.get();
                 }
-            } catch (const MimError &e) {
-                throw e;
             }
         }
 
-        void start(void) {
-            this->editor_state = Mim::MimState::running;
+        // left gets first row rows of t, right gets the rest; chunk cut in two gives its tail a new node
+        void split(NodePtr t, size_t row, NodePtr &left, NodePtr &right) {
+            if (!t) {
+                left.reset();
+                right.reset();
+                return;
+            }
 
-            while (this->editor_state == Mim::MimState::running) {
-                try {
-                    this->refreshScreen();
-                    this->refreshBuffer();
-                    this->processKeyPress();
-                } catch (const MimError &e) {
-                    throw e;
-                }
+            size_t left_size = LineStates::sizeOf(t->left);
+            size_t chunk_end = left_size + t->rows.size();
+
+            if (row <= left_size) {
+                this->split(move(t->left), row, left, t->left);
+                LineStates::update(t.get());
+                right = move(t);
+            } else if (row >= chunk_end) {
+                this->split(move(t->right), row - chunk_end, t->right, right);
+                LineStates::update(t.get());
+                left = move(t);
+            } else {
+                size_t at = row - left_size;
+                NodePtr tail = this->makeNode(t->rows.size() - at);
+                copy(t->rows.begin() + at, t->rows.end(), tail->rows.begin());
+                t->rows.resize(at);
+
+                right = LineStates::merge(move(tail), move(t->right));
+                LineStates::update(t.get());
+                left = move(t);
             }
         }
 
-        void open(const char *filename) {
-            try {
-                if (filename == NULL) {
-                    return;
-                }
+        static NodePtr merge(NodePtr left, NodePtr right) {
+            if (!left) {
+                return right;
+            }
 
-                this->openFile(filename);
-            } catch (const MimError &e) {
-                throw e;
+            if (!right) {
+                return left;
+            }
+
+            if (left->priority > right->priority) {
+                left->right = LineStates::merge(move(left->right), move(right));
+                LineStates::update(left.get());
+                return left;
             }
+
+            right->left = LineStates::merge(move(left), move(right->left));
+            LineStates::update(right.get());
+            return right;
         }
+};
 
-    protected:
-        const MimConfig &get_config(void) const {
-            return this->config;
+/*** input buffer ***/
+
+// fixed size byte ring filled by large reads from terminal
+class RingBuffer {
+    public:
+        RingBuffer(void) {
+            this->head = 0;
+            this->count = 0;
         }
 
-        void set_config(const MimConfig &config) {
-            this->config.screen_rows = config.screen_rows;
-            this->config.screen_cols = config.screen_cols;
-            this->config.tabs_width = config.tabs_width;
-            this->config.set_num = config.set_num;
-            this->config.verbose = config.verbose;
-            this->config.orig_termios = config.orig_termios;
+        size_t size(void) const {
+            return this->count;
         }
 
-    private:
-        enum MimState {
-            stoped,
-            running,
-            pending
-        };
+        bool empty(void) const {
+            return this->count == 0;
+        }
 
-        enum MimMode {
-            command,
-            insert
-        };
+        bool full(void) const {
+            return this->count == RingBuffer::capacity;
+        }
 
-        enum LastlineMode {
-            normal,
-            search,
-            save
-        };
+        char operator[](size_t idx) const {
+            return this->data[(this->head + idx) & (RingBuffer::capacity - 1)];
+        }
 
-        enum Direction {
-            backward = -1,
-            input,
-            forward
-        };
+        // append first n bytes to out
+        void copyTo(string &out, size_t n) const {
+            n = min(n, this->count);
+            size_t first = min(n, RingBuffer::capacity - this->head);
+            out.append(this->data + this->head, first);
+            out.append(this->data, n - first);
+        }
 
-        enum HL {
-            plain = 0,
-            comment,
-            mlcomment,
-            keyword_type,
-            keyword_statement,
-            str,
-            number,
-            match
-        };
+        void pop(size_t n) {
+            n = min(n, this->count);
+            this->head = (this->head + n) & (RingBuffer::capacity - 1);
+            this->count -= n;
+        }
 
-        MimState editor_state;
-        MimMode editor_mode;
-        MimConfig config;
-        const string version = "1.0.0";
+        // read what fd has into free space, returns bytes read or -1
+        ssize_t fill(int fd) {
+            ssize_t total = 0;
 
-        int cx;      // column number in the file (start with 0) (not cursor position)
-        int cy;      // row number in the file (start with 0) (not cursor position)
-        int rx;      // rendered column number
-        int rx_base; // change according to config.set_num
+            while (!this->full()) {
+                size_t tail = (this->head + this->count) & (RingBuffer::capacity - 1);
+                size_t space = min(RingBuffer::capacity - this->count, RingBuffer::capacity - tail);
+                ssize_t nread = read(fd, this->data + tail, space);
 
-        int num_rows;
-        int row_off;
-        int col_off;
-        vector<RowBuffer> rows_buffer;
+                if (nread == -1) {
+                    if (errno == EAGAIN || errno == EINTR) {
+                        break;
+                    }
 
-        string screen_buffer;
-        string command_buffer;
-        string lastline_buffer;
+                    return -1;
+                }
 
-        time_t lastline_time;   // lastline update timer
+                if (nread == 0) {
+                    break;
+                }
 
-        int last_search_row;
-        string last_search_buffer;
-        string last_search_hl;
+                this->count += nread;
+                total += nread;
 
-        vector<string> keywords_type;
-        vector<string> keywords_statement;
+                if ((size_t)nread < space) {
+                    break;
+                }
+            }
 
-        bool dirty_flag;
-        bool force_quit;
+            return total;
+        }
 
-        string editor_filename;
-        FILE *log;
+    private:
+        static const size_t capacity = 64 * 1024;   // power of 2
 
-        /*** terminal ***/
+        char data[RingBuffer::capacity];
+        size_t head;
+        size_t count;
+};
 
-        void enableRawMode(void) {
-            if (tcgetattr(STDIN_FILENO, &(this->config.orig_termios)) == -1) {
-                throw MimError("Get terminal mode failed.");
+/*** signals ***/
+
+static int signal_pipe[2] = { -1, -1 };
+
+// wake up event loop, handled there
+static void notifySignal(int signo) {
+    int saved_errno = errno;
+    char ch = signo;
+
+    if (write(signal_pipe[1], &ch, 1) == -1) {
+        // pipe full, a wake up is pending anyway
+    }
+
+    errno = saved_errno;
+}
+
+/*** workers ***/
+
+// fixed threads sharing the tasks of one job at a time
+class WorkerPool {
+    public:
+        WorkerPool(void) {
+            this->started = false;
+            this->stopping = false;
+            this->job = NULL;
+            this->next_task = 0;
+            this->num_tasks = 0;
+            this->unfinished = 0;
+        }
+
+        ~WorkerPool(void) {
+            {
+                lock_guard<mutex> guard(this->lock);
+                this->stopping = true;
             }
 
-            struct termios raw = this->config.orig_termios;
+            this->work_ready.notify_all();
 
-            // turn on raw mode
-            raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-            raw.c_oflag &= ~(OPOST);
-            raw.c_cflag |= (CS8);
-            raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+            for (size_t i = 0; i < this->threads.size(); ++i) {
+                this->threads[i].join();
+            }
+        }
 
-            // set timeout for read
-            raw.c_cc[VMIN] = 0;
-            raw.c_cc[VTIME] = 1;
+        // call func(0) .. func(tasks - 1), caller joins the work, return when all done
+        void run(int tasks, const function<void(int)> &func) {
+            if (!this->started) {
+                this->start();
+            }
 
-            if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
-                throw MimError("Set terminal mode failed.");
+            {
+                lock_guard<mutex> guard(this->lock);
+                this->job = &func;
+                this->next_task = 0;
+                this->num_tasks = tasks;
+                this->unfinished = tasks;
             }
+
+            this->work_ready.notify_all();
+            this->work();
+
+            unique_lock<mutex> guard(this->lock);
+            this->all_done.wait(guard, [this] { return this->unfinished == 0; });
+            this->job = NULL;
         }
 
-        void disableRawMode(void) {
-            if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &(this->config.orig_termios)) == -1) {
-                throw MimError("Set terminal mode failed.");
+        // threads running a job (caller included)
+        int size(void) {
+            if (!this->started) {
+                this->start();
             }
+
+            return this->threads.size() + 1;
         }
 
-        void updateCursorBase(void) {
-            if (this->config.set_num) {
-                int num_rows = this->num_rows;
-                this->rx_base = 0;
+    private:
+        bool started;
+        bool stopping;
+        const function<void(int)> *job;
+        int next_task;
+        int num_tasks;
+        int unfinished;
+        mutex lock;
+        condition_variable work_ready;
+        condition_variable all_done;
+        vector<thread> threads;
 
-                do {
-                    ++this->rx_base;
-                    num_rows /= 10;
-                } while (num_rows);
+        void start(void) {
+            unsigned int cores = thread::hardware_concurrency();
 
-                ++this->rx_base; // for " " placeholder after line number
+            for (unsigned int i = 1; i < cores; ++i) {
+                this->threads.push_back(thread(&WorkerPool::loop, this));
             }
+
+            this->started = true;
         }
 
-        int readKey(void) {
-            int nread;
-            char ch;
+        void loop(void) {
+            unique_lock<mutex> guard(this->lock);
 
-            while ((nread = read(STDIN_FILENO, &ch, 1)) != 1) {
-                if (nread == -1 && errno != EAGAIN) {
-                    throw MimError("Input failed.");
+            while (true) {
+                this->work_ready.wait(guard, [this] {
+                    return this->stopping || (this->job != NULL && this->next_task < this->num_tasks);
+                });
+
+                if (this->stopping) {
+                    return;
                 }
+
+                guard.unlock();
+                this->work();
+                guard.lock();
             }
+        }
 
-            if (ch == KEY_ESC) {
-                char seq[3];
+        // take tasks of current job until none left
+        void work(void) {
+            unique_lock<mutex> guard(this->lock);
 
-                if (read(STDIN_FILENO, &seq[0], 1) != 1) {
-                    return KEY_ESC;
-                }
+            while (this->job != NULL && this->next_task < this->num_tasks) {
+                const function<void(int)> *job = this->job;
+                int task = this->next_task++;
 
-                if (read(STDIN_FILENO, &seq[1], 1) != 1) {
-                    return KEY_ESC;
+                guard.unlock();
+                (*job)(task);
+                guard.lock();
+
+                if (--this->unfinished == 0) {
+                    this->all_done.notify_all();
                 }
+            }
+        }
+};
 
-                if (seq[0] == '[') {
-                    if (seq[1] >= '0' && seq[1] <= '9') {
-                        if (read(STDIN_FILENO, &seq[2], 1) != 1) {
-                            return KEY_ESC;
-                        }
+/*** row cache ***/
 
-                        if (seq[2] == '~') {
-                            switch (seq[1]) {
-                                case '1':
-                                    return KEY_HOME;
-                                case '3':
-                                    return KEY_DEL;
-                                case '4':
-                                    return KEY_END;
-                                case '5':
-                                    return KEY_PAGE_UP;
-                                case '6':
-                                    return KEY_PAGE_DOWN;
-                                case '7':
-                                    return KEY_HOME;
-                                case '8':
-                                    return KEY_END;
-                            }
-                        }
-                    } else {
-                        switch (seq[1]) {
-                            case 'A':
-                                return KEY_ARROW_UP;
-                            case 'B':
-                                return KEY_ARROW_DOWN;
-                            case 'C':
-                                return KEY_ARROW_RIGHT;
-                            case 'D':
-                                return KEY_ARROW_LEFT;
-                            case 'H':
-                                return KEY_HOME;
-                            case 'F':
-                                return KEY_END;
-                            default:
-                                return KEY_ESC;
-                        }
-                    }
-                } else if (seq[0] == 'O') {
-                    switch (seq[1]) {
-                        case 'H':
-                            return KEY_HOME;
-                        case 'F':
-                            return KEY_END;
-                    }
-                }
+// rendered rows in LRU order, bounded by a memory budget
+class RowCache {
+    public:
+        RowCache(void) {
+            this->used = 0;
+        }
+
+        // look up row and mark it as recently used
+        RowBuffer *find(int num_row) {
+            map<int, Entry>::iterator it = this->entries.find(num_row);
+
+            if (it == this->entries.end()) {
+                return NULL;
             }
 
-            return ch;
+            this->lru.splice(this->lru.begin(), this->lru, it->second.lru);
+            return &it->second.row;
         }
 
-        const struct winsize getWindowSize(void) {
-            struct winsize ws;
+        RowBuffer &put(int num_row, RowBuffer &row) {
+            map<int, Entry>::iterator it = this->entries.find(num_row);
 
-            if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-                throw MimError("Get window size failed.");
+            if (it == this->entries.end()) {
+                this->lru.push_front(num_row);
+                it = this->entries.insert(make_pair(num_row, Entry())).first;
+                it->second.lru = this->lru.begin();
+            } else {
+                this->used -= it->second.size;
+                this->lru.splice(this->lru.begin(), this->lru, it->second.lru);
             }
 
-            return ws;
+            Entry &entry = it->second;
+            swap(entry.row.raw, row.raw);
+            swap(entry.row.render, row.render);
+            swap(entry.row.hl, row.hl);
+            swap(entry.row.tabs, row.tabs);
+            entry.size = sizeof(Entry) + entry.row.raw.capacity() + entry.row.render.capacity() + entry.row.hl.capacity() +
+                entry.row.tabs.capacity() * sizeof(TabStop);
+            this->used += entry.size;
+
+            return entry.row;
         }
 
-        const CursorPosition getCursorPosition(void) {
-            char buf[32];
-            int row = 0;
-            int col = 0;
+        void erase(int num_row) {
+            map<int, Entry>::iterator it = this->entries.find(num_row);
 
-            if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) {
-                throw MimError("Get cursor position failed.");
+            if (it != this->entries.end()) {
+                this->erase(it);
             }
+        }
 
-            for (unsigned int i = 0; i < sizeof(buf) - 1; ++i) {
-                if (read(STDIN_FILENO, &buf[i], 1) != 1 || buf[i] == 'R')  {
-                    buf[i] = '\0';
+        // drop rows from num_row to the end
+        void eraseFrom(int num_row) {
+            map<int, Entry>::iterator it = this->entries.lower_bound(num_row);
+
+            while (it != this->entries.end()) {
+                this->erase(it++);
+            }
+        }
+
+        void clear(void) {
+            this->entries.clear();
+            this->lru.clear();
+            this->used = 0;
+        }
+
+        // evict least recently used rows out of [keep_begin, keep_end) until within budget
+        void trim(size_t budget, int keep_begin, int keep_end) {
+            while (this->used > budget && !this->lru.empty()) {
+                int num_row = this->lru.back();
+
+                if (num_row >= keep_begin && num_row < keep_end) {
                     break;
                 }
+
+                this->erase(this->entries.find(num_row));
             }
+        }
 
-            if (buf[0] != '\x1b' || buf[1] != '[') {
-                throw MimError("Get cursor position failed.");
+        size_t size(void) const {
+            return this->used;
+        }
+
+    private:
+        struct Entry {
+            RowBuffer row;
+            list<int>::iterator lru;
+            size_t size;
+
+            Entry(void) {
+                this->size = 0;
             }
+        };
 
-            if (sscanf(&buf[2], "%d;%d", &row, &col) != 2) {
-                throw MimError("Get cursor position failed.");
+        map<int, Entry> entries;
+        list<int> lru;  // most recently used first
+        size_t used;    // bytes held by entries
+
+        void erase(map<int, Entry>::iterator it) {
+            this->used -= it->second.size;
+            this->lru.erase(it->second.lru);
+            this->entries.erase(it);
+        }
+};
+
+/*** newline index ***/
+
+#ifdef MIM_X86_SIMD
+__attribute__((target("avx2")))
+static size_t scanNewlinesAVX2(const char *data, size_t length, vector<size_t> &lines) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+
+        while (mask) {
+            lines.push_back(i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+
+    return i;
+}
+
+__attribute__((target("sse2")))
+static size_t scanNewlinesSSE2(const char *data, size_t length, vector<size_t> &lines) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+
+        while (mask) {
+            lines.push_back(i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+
+    return i;
+}
+#endif
+
+// append offsets of all '\n' in data to lines
+static void scanNewlines(const char *data, size_t length, vector<size_t> &lines) {
+    size_t i = 0;
+
+#ifdef MIM_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        i = scanNewlinesAVX2(data, length, lines);
+    } else if (__builtin_cpu_supports("sse2")) {
+        i = scanNewlinesSSE2(data, length, lines);
+    }
+#endif
+
+    for (; i < length; ++i) {
+        if (data[i] == '\n') {
+            lines.push_back(i);
+        }
+    }
+}
+
+/*** piece table ***/
+
+struct Piece {
+    const char *data;
+    size_t length;
+    size_t lines;   // number of '\n' in piece
+    bool original;  // points into original buffer (newline index available)
+
+    Piece(void) {
+        this->data = NULL;
+        this->length = 0;
+        this->lines = 0;
+        this->original = false;
+    }
+
+    Piece(const char *data, size_t length, size_t lines, bool original) {
+        this->data = data;
+        this->length = length;
+        this->lines = lines;
+        this->original = original;
+    }
+};
+
+// buffers pieces point into, alive as long as any snapshot uses them
+struct TextStorage {
+    const char *original;                   // mapped file
+    size_t original_length;
+    vector<size_t> original_lines;          // offsets of '\n' in original buffer
+    vector<unique_ptr<char[]>> add_blocks;  // append-only, never reallocated
+
+    TextStorage(void) {
+        this->original = NULL;
+        this->original_length = 0;
+    }
+
+    ~TextStorage(void) {
+        if (this->original != NULL) {
+            munmap((void *)this->original, this->original_length);
+        }
+    }
+};
+
+// text at one edit version, nodes and bytes are never modified (safe to read from other threads)
+class TextSnapshot {
+    public:
+        TextSnapshot(void) {
+            this->version = 0;
+        }
+
+        // bumped by every edit of the table
+        unsigned int getVersion(void) const {
+            return this->version;
+        }
+
+        size_t length(void) const {
+            return TextSnapshot::lengthOf(this->root);
+        }
+
+        // number of '\n' in buffer
+        size_t lines(void) const {
+            return TextSnapshot::linesOf(this->root);
+        }
+
+        // byte offset of the first char of line
+        size_t lineOffset(size_t line) const {
+            if (line == 0) {
+                return 0;
             }
 
-            return CursorPosition(row, col);
+            const Node *t = this->root.get();
+            size_t offset = 0;
+
+            while (t) {
+                size_t left_lines = TextSnapshot::linesOf(t->left);
+
+                if (line <= left_lines) {
+                    t = t->left.get();
+                    continue;
+                }
+
+                line -= left_lines;
+                offset += TextSnapshot::lengthOf(t->left);
+
+                if (line <= t->piece.lines) {
+                    return offset + this->newlineInPiece(t->piece, line) + 1;
+                }
+
+                line -= t->piece.lines;
+                offset += t->piece.length;
+                t = t->right.get();
+            }
+
+            return this->length();
         }
 
-        /*** manipulation ***/
+        // line holding byte at offset
+        size_t lineAt(size_t offset) const {
+            const Node *t = this->root.get();
+            size_t line = 0;
 
-        void closeEditor(void) {
-            if (this->dirty_flag && !this->force_quit) {
-                this->updateLastlineBuffer("[WARN] File has unsaved changes (Add '!' flag to force quit)");
-            } else {
-                this->editor_state = Mim::MimState::stoped;
-                this->clearScreen();
-                this->refreshBuffer();
+            while (t) {
+                size_t left_length = TextSnapshot::lengthOf(t->left);
+
+                if (offset < left_length) {
+                    t = t->left.get();
+                    continue;
+                }
+
+                line += TextSnapshot::linesOf(t->left);
+                offset -= left_length;
+
+                if (offset < t->piece.length) {
+                    return line + this->newlinesInPiece(t->piece, offset);
+                }
+
+                line += t->piece.lines;
+                offset -= t->piece.length;
+                t = t->right.get();
             }
+
+            return line;
         }
 
-        /*** input ***/
+        // line length without '\n'
+        size_t lineLength(size_t line) const {
+            size_t begin = this->lineOffset(line);
 
-        inline void keyMoveCursor(const int &key) {
-            string row = (this->cy < this->num_rows) ? this->rows_buffer[this->cy].raw : "";
-            bool end_of_line = (this->cx >= (int)row.length());
+            if (line >= this->lines()) {
+                return this->length() - begin;
+            }
 
-            switch (key) {
-                case KEY_ARROW_LEFT:
-                    if (this->cx != 0) {
-                        --this->cx;
-                    } else if (this->cy > 0) {
-                        --this->cy;
-                        this->keyHomeEnd(KEY_END);
-                    }
+            return this->lineOffset(line + 1) - begin - 1;
+        }
 
-                    break;
-                case KEY_ARROW_RIGHT:
-                    if (this->cx < (int)row.length()) {
-                        ++this->cx;
-                    } else if (end_of_line && this->cy < this->num_rows) {
-                        ++this->cy;
-                        this->keyHomeEnd(KEY_HOME);
-                    }
+        const string line(size_t line) const {
+            string ret = "";
+            size_t begin = this->lineOffset(line);
+            this->read(begin, begin + this->lineLength(line), ret);
+            return ret;
+        }
 
-                    break;
-                case KEY_ARROW_UP:
-                    if (this->cy != 0) {
-                        --this->cy;
-                    }
+        // append bytes in [begin, end) to out
+        void read(size_t begin, size_t end, string &out) const {
+            TextSnapshot::collect(this->root.get(), begin, end, out);
+        }
 
-                    if (end_of_line) {
-                        this->keyHomeEnd(KEY_END);
-                    }
+        // bytes in [begin, end), in place when one piece holds them, else copied to scratch
+        const char *span(size_t begin, size_t end, string &scratch) const {
+            const Node *t = this->root.get();
+            size_t offset = begin;
+
+            while (t) {
+                size_t left_length = TextSnapshot::lengthOf(t->left);
 
+                if (offset < left_length) {
+                    t = t->left.get();
+                } else if (offset - left_length < t->piece.length) {
+                    offset -= left_length;
                     break;
-                case KEY_ARROW_DOWN:
-                    if (this->cy < this->num_rows) {
-                        ++this->cy;
-                    }
+                } else {
+                    offset -= left_length + t->piece.length;
+                    t = t->right.get();
+                }
+            }
 
-                    if (end_of_line) {
-                        this->keyHomeEnd(KEY_END);
-                    }
+            if (t != NULL && offset + (end - begin) <= t->piece.length) {
+                return t->piece.data + offset;
+            }
 
-                    break;
-                default:
-                    break;
+            scratch.clear();
+            this->read(begin, end, scratch);
+            return scratch.data();
+        }
+
+        // visit pieces in order
+        template<typename Func>
+        void forEachPiece(Func func) const {
+            TextSnapshot::visit(this->root.get(), func);
+        }
+
+    protected:
+        struct Node;
+        typedef shared_ptr<const Node> NodePtr;
+
+        // nodes are immutable, edits copy the path from root
+        struct Node {
+            Piece piece;
+            unsigned int priority;
+            NodePtr left;
+            NodePtr right;
+            size_t length;  // bytes in subtree
+            size_t lines;   // '\n' in subtree
+
+            Node(const Piece &piece, unsigned int priority, const NodePtr &left, const NodePtr &right)
+                : piece(piece), priority(priority), left(left), right(right) {
+                this->length = piece.length + TextSnapshot::lengthOf(left) + TextSnapshot::lengthOf(right);
+                this->lines = piece.lines + TextSnapshot::linesOf(left) + TextSnapshot::linesOf(right);
             }
+        };
 
-            row = (this->cy < this->num_rows) ? this->rows_buffer[this->cy].raw : "";
-            this->cx = min(this->cx, (int)row.length());
+        NodePtr root;
+        shared_ptr<TextStorage> storage;
+        unsigned int version;
+
+        static size_t lengthOf(const NodePtr &t) {
+            return t ? t->length : 0;
         }
 
-        inline void keyPageUpDown(const int &key) {
-            if (key == KEY_PAGE_UP) {
-                // to the top of screen
-                this->cy = this->row_off;
-            } else {
-                // to the bottom of screen
-                this->cy = min(this->row_off + this->config.screen_rows - 1, this->num_rows);
+        static size_t linesOf(const NodePtr &t) {
+            return t ? t->lines : 0;
+        }
+
+        // offset (in piece) of nth (start with 1) '\n'
+        size_t newlineInPiece(const Piece &piece, size_t nth) const {
+            if (piece.original) {
+                const vector<size_t> &lines = this->storage->original_lines;
+                size_t begin = piece.data - this->storage->original;
+                vector<size_t>::const_iterator it = lower_bound(lines.begin(), lines.end(), begin);
+                return *(it + nth - 1) - begin;
             }
 
-            int times = this->config.screen_rows;
+            const char *p = piece.data;
+
+            while (true) {
+                p = (const char *)memchr(p, '\n', piece.data + piece.length - p);
+
+                if (--nth == 0) {
+                    return p - piece.data;
+                }
 
-            while (times--) {
-                keyMoveCursor(key == KEY_PAGE_UP ? KEY_ARROW_UP : KEY_ARROW_DOWN);
+                ++p;
             }
         }
 
-        inline void keyHomeEnd(const int &key) {
-            switch (key) {
-                case KEY_HOME:
-                    this->cx = 0;
-                    break;
-                case KEY_END:
-                    {
-                        string row = (this->cy < this->num_rows) ? this->rows_buffer[this->cy].raw : "";
-                        this->cx = row.length();
-                        break;
-                    }
-                default:
-                    break;
+        // number of '\n' in first length bytes of piece
+        size_t newlinesInPiece(const Piece &piece, size_t length) const {
+            if (piece.original) {
+                const vector<size_t> &lines = this->storage->original_lines;
+                size_t begin = piece.data - this->storage->original;
+                return lower_bound(lines.begin(), lines.end(), begin + length) - lower_bound(lines.begin(), lines.end(), begin);
             }
+
+            return count(piece.data, piece.data + length, '\n');
         }
 
-        inline void enterCommandMode(void) {
-            this->editor_mode = Mim::MimMode::command;
+        static void collect(const Node *t, size_t begin, size_t end, string &out) {
+            if (t == NULL || begin >= end) {
+                return;
+            }
+
+            size_t left_length = TextSnapshot::lengthOf(t->left);
+            size_t piece_end = left_length + t->piece.length;
+
+            if (begin < left_length) {
+                TextSnapshot::collect(t->left.get(), begin, min(end, left_length), out);
+            }
+
+            if (begin < piece_end && end > left_length) {
+                size_t from = max(begin, left_length) - left_length;
+                size_t to = min(end, piece_end) - left_length;
+                out.append(t->piece.data + from, to - from);
+            }
+
+            if (end > piece_end) {
+                TextSnapshot::collect(t->right.get(), max(begin, piece_end) - piece_end, end - piece_end, out);
+            }
         }
 
-        inline void enterInsertMode(void) {
-            this->updateLastlineBuffer("-- INSERT --");
-            this->editor_mode = Mim::MimMode::insert;
+        template<typename Func>
+        static void visit(const Node *t, Func &func) {
+            if (t == NULL) {
+                return;
+            }
+
+            TextSnapshot::visit(t->left.get(), func);
+            func(t->piece);
+            TextSnapshot::visit(t->right.get(), func);
         }
+};
 
-        void processKeyPressInCommandMode(const int &ch) {
-            switch (ch) {
-                // insert
-                case 'A':
-                    this->keyHomeEnd(KEY_END);
-                    this->enterInsertMode();
-                    break;
-                case 'I':
-                    this->keyHomeEnd(KEY_HOME);
-                    this->enterInsertMode();
-                    break;
+class PieceTable : public TextSnapshot {
+    public:
+        PieceTable(void) {
+            this->seed = 2463534242u;
+            this->clear();
+        }
+
+        void clear(void) {
+            // mapping is released with the last snapshot using it
+            this->root.reset();
+            this->storage = make_shared<TextStorage>();
+            this->add_used = PieceTable::block_size;
+            ++this->version;
+        }
+
+        // map file as original (read-only) buffer
+        void load(int fd) {
+            struct stat st;
+
+            this->clear();
+
+            if (fstat(fd, &st) == -1) {
+                throw MimError("Stat file failed.");
+            }
+
+            size_t length = st.st_size;
+
+            if (length == 0) {
+                return;
+            }
+
+            void *addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (addr == MAP_FAILED) {
+                throw MimError("Map file failed.");
+            }
+
+            TextStorage &storage = *this->storage;
+            storage.original = (const char *)addr;
+            storage.original_length = length;
+
+            madvise(addr, length, MADV_SEQUENTIAL);
+            scanNewlines(storage.original, length, storage.original_lines);
+            madvise(addr, length, MADV_NORMAL);
+
+            this->root = this->makeNode(Piece(storage.original, length, storage.original_lines.size(), true), NULL, NULL);
+
+            // every row is terminated by '\n'
+            if (storage.original[length - 1] != '\n') {
+                this->insert(length, "\n", 1);
+            }
+        }
+
+        // take over text of other table holding same bytes (file just saved and mapped), other is left empty
+        void adopt(PieceTable &other) {
+            this->root = other.root;
+            this->storage = other.storage;
+            this->add_used = other.add_used;
+            ++this->version;
+            other.clear();
+        }
+
+        // current text, unaffected by later edits
+        TextSnapshot snapshot(void) const {
+            return *this;
+        }
+
+        void insert(size_t offset, const char *str, size_t length) {
+            NodePtr left, right;
+            PieceTable::split(this->root, offset, left, right);
+
+            while (length) {
+                size_t n = this->appendToAddBuffer(str,
+                        length < PieceTable::piece_size ? length : PieceTable::piece_size);
+                const char *data = this->storage->add_blocks.back().get() + this->add_used - n;
+                size_t lines = PieceTable::countLines(data, n);
+                const Piece *last = PieceTable::lastPiece(left);
+
+                if (last != NULL && !last->original && last->data + last->length == data
+                        && last->length + n <= PieceTable::piece_size) {
+                    // continue typing at the end of last piece
+                    left = PieceTable::growLast(left, n, lines);
+                } else {
+                    left = PieceTable::merge(left, this->makeNode(Piece(data, n, lines, false), NULL, NULL));
+                }
+
+                str += n;
+                length -= n;
+            }
+
+            this->root = PieceTable::merge(left, right);
+            ++this->version;
+        }
+
+        void insert(size_t offset, const string &str) {
+            this->insert(offset, str.c_str(), str.length());
+        }
+
+        void erase(size_t offset, size_t length) {
+            NodePtr left, middle, right;
+            PieceTable::split(this->root, offset, left, middle);
+            PieceTable::split(middle, length, middle, right);
+            this->root = PieceTable::merge(left, right);
+            ++this->version;
+        }
+
+    private:
+        static const size_t block_size = 64 * 1024;
+        static const size_t piece_size = 4 * 1024;  // add pieces are scanned for '\n', keep them short
+
+        size_t add_used;                    // bytes used in last block
+        unsigned int seed;
+
+        static size_t countLines(const char *data, size_t length) {
+            size_t lines = 0;
+
+            for (const char *end = data + length; (data = (const char *)memchr(data, '\n', end - data)) != NULL; ++data) {
+                ++lines;
+            }
+
+            return lines;
+        }
+
+        unsigned int random(void) {
+            // xorshift32
+            this->seed ^= this->seed << 13;
+            this->seed ^= this->seed >> 17;
+            this->seed ^= this->seed << 5;
+            return this->seed;
+        }
+
+        NodePtr makeNode(const Piece &piece, const NodePtr &left, const NodePtr &right) {
+            return make_shared<const Node>(piece, this->random(), left, right);
+        }
+
+        static NodePtr copyNode(const Node *t, const Piece &piece, const NodePtr &left, const NodePtr &right) {
+            return make_shared<const Node>(piece, t->priority, left, right);
+        }
+
+        Piece subPiece(const Piece &piece, size_t begin, size_t length) const {
+            const char *data = piece.data + begin;
+            size_t lines = 0;
+
+            if (piece.original) {
+                const vector<size_t> &original_lines = this->storage->original_lines;
+                size_t begin = data - this->storage->original;
+                lines = lower_bound(original_lines.begin(), original_lines.end(), begin + length)
+                    - lower_bound(original_lines.begin(), original_lines.end(), begin);
+            } else {
+                lines = PieceTable::countLines(data, length);
+            }
+
+            return Piece(data, length, lines, piece.original);
+        }
+
+        size_t appendToAddBuffer(const char *str, size_t length) {
+            vector<unique_ptr<char[]>> &add_blocks = this->storage->add_blocks;
+
+            if (this->add_used == PieceTable::block_size) {
+                add_blocks.push_back(unique_ptr<char[]>(new char[PieceTable::block_size]));
+                this->add_used = 0;
+            }
+
+            size_t n = min(length, PieceTable::block_size - this->add_used);
+            memcpy(add_blocks.back().get() + this->add_used, str, n);
+            this->add_used += n;
+
+            return n;
+        }
+
+        // left gets first offset bytes of t, right gets the rest
+        void split(NodePtr t, size_t offset, NodePtr &left, NodePtr &right) {
+            Piece tail;
+            this->cut(t, offset, left, right, tail);
+
+            // tail of a piece cut in two gets a priority of its own (pieces cut again and again would chain
+            // on equal ones), merged once it is the first piece of right so heap order holds
+            if (tail.length) {
+                right = PieceTable::merge(this->makeNode(tail, NULL, NULL), right);
+            }
+        }
+
+        // split without tail of piece cut at offset, tail is left to caller
+        void cut(NodePtr t, size_t offset, NodePtr &left, NodePtr &right, Piece &tail) const {
+            if (!t) {
+                left.reset();
+                right.reset();
+                return;
+            }
+
+            size_t left_length = PieceTable::lengthOf(t->left);
+            size_t piece_end = left_length + t->piece.length;
+
+            if (offset <= left_length) {
+                NodePtr rest;
+                this->cut(t->left, offset, left, rest, tail);
+                right = PieceTable::copyNode(t.get(), t->piece, rest, t->right);
+            } else if (offset >= piece_end) {
+                NodePtr rest;
+                this->cut(t->right, offset - piece_end, rest, right, tail);
+                left = PieceTable::copyNode(t.get(), t->piece, t->left, rest);
+            } else {
+                size_t at = offset - left_length;
+                tail = this->subPiece(t->piece, at, t->piece.length - at);
+                left = PieceTable::copyNode(t.get(), this->subPiece(t->piece, 0, at), t->left, NULL);
+                right = t->right;
+            }
+        }
+
+        static NodePtr merge(const NodePtr &left, const NodePtr &right) {
+            if (!left) {
+                return right;
+            }
+
+            if (!right) {
+                return left;
+            }
+
+            if (left->priority > right->priority) {
+                return PieceTable::copyNode(left.get(), left->piece, left->left, PieceTable::merge(left->right, right));
+            }
+
+            return PieceTable::copyNode(right.get(), right->piece, PieceTable::merge(left, right->left), right->right);
+        }
+
+        static const Piece *lastPiece(const NodePtr &t) {
+            const Node *node = t.get();
+
+            while (node && node->right) {
+                node = node->right.get();
+            }
+
+            return node ? &node->piece : NULL;
+        }
+
+        static NodePtr growLast(const NodePtr &t, size_t length, size_t lines) {
+            if (t->right) {
+                return PieceTable::copyNode(t.get(), t->piece, t->left, PieceTable::growLast(t->right, length, lines));
+            }
+
+            Piece piece = t->piece;
+            piece.length += length;
+            piece.lines += lines;
+            return PieceTable::copyNode(t.get(), piece, t->left, NULL);
+        }
+};
+
+/*** journal ***/
+
+// append-only log of buffer edits next to file, replayed onto file after a crash
+// header: magic, then size, mtime and inode of file the edits apply to
+// record: op ('+' insert, '-' erase), offset, length, checksum, inserted bytes
+class Journal {
+    public:
+        Journal(void) {
+            this->fd = -1;
+            this->logged = 0;
+            this->stopping = false;
+            memset(&this->base, 0, sizeof(this->base));
+        }
+
+        ~Journal(void) {
+            this->close();
+        }
+
+        // ".name.mim-journal" next to file
+        static string pathOf(const string &filename) {
+            size_t slash = filename.rfind('/');
+            string dir = (slash == string::npos) ? "" : filename.substr(0, slash + 1);
+            string name = (slash == string::npos) ? filename : filename.substr(slash + 1);
+            return dir + "." + name + ".mim-journal";
+        }
+
+        // log edits of file (as in st) to path, file is created at first edit
+        void attach(const string &path, const struct stat &st) {
+            this->close();
+            this->path = path;
+            this->base = st;
+            this->logged = 0;
+        }
+
+        // apply records of existing journal to text (loaded from attached file)
+        // returns number of records, -1 if journal is for another version of file
+        long replay(PieceTable &text) {
+            if (this->path.empty()) {
+                return 0;
+            }
+
+            int in = ::open(this->path.c_str(), O_RDONLY);
+
+            if (in == -1) {
+                return 0;
+            }
+
+            string data = "";
+            char buf[64 * 1024];
+            ssize_t n;
+
+            while ((n = read(in, buf, sizeof(buf))) > 0) {
+                data.append(buf, n);
+            }
+
+            ::close(in);
+
+            if (data.length() < Journal::header_size || data.compare(0, Journal::header_size, this->header()) != 0) {
+                return -1;
+            }
+
+            long records = 0;
+            size_t pos = Journal::header_size;
+
+            while (pos + Journal::record_size <= data.length()) {
+                char op = data[pos];
+                uint64_t offset, length;
+                uint32_t checksum;
+                memcpy(&offset, &data[pos + 1], sizeof(offset));
+                memcpy(&length, &data[pos + 9], sizeof(length));
+                memcpy(&checksum, &data[pos + 17], sizeof(checksum));
+
+                size_t bytes = (op == '+') ? length : 0;
+
+                if ((op != '+' && op != '-') || bytes > data.length() - pos - Journal::record_size) {
+                    break;  // torn write at crash
+                }
+
+                const char *inserted = data.data() + pos + Journal::record_size;
+
+                if (checksum != Journal::checksumOf(op, offset, length, inserted, bytes)) {
+                    break;
+                }
+
+                if (op == '+' && offset <= text.length()) {
+                    text.insert(offset, inserted, length);
+                } else if (op == '-' && offset + length <= text.length()) {
+                    text.erase(offset, length);
+                } else {
+                    break;
+                }
+
+                pos += Journal::record_size + bytes;
+                ++records;
+            }
+
+            // keep appending after last good record
+            if (truncate(this->path.c_str(), pos) == 0) {
+                this->fd = ::open(this->path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+
+                if (this->fd != -1) {
+                    this->logged = pos - Journal::header_size;
+                    this->startFlusher();
+                }
+            }
+
+            return records;
+        }
+
+        void insert(size_t offset, const char *str, size_t length) {
+            this->append('+', offset, length, str, length);
+        }
+
+        void erase(size_t offset, size_t length) {
+            this->append('-', offset, length, NULL, 0);
+        }
+
+        // bytes of records logged so far
+        size_t position(void) const {
+            return this->logged;
+        }
+
+        // file replaced by text at position mark: keep records after mark only, relative to new file
+        void rebase(const struct stat &st, size_t mark) {
+            bool created = (this->fd != -1);
+
+            if (this->path.empty()) {
+                return;
+            }
+
+            string tail = "";
+
+            this->close();
+
+            if (created) {
+                int in = ::open(this->path.c_str(), O_RDONLY);
+
+                if (in != -1) {
+                    char buf[64 * 1024];
+                    ssize_t n;
+
+                    lseek(in, Journal::header_size + mark, SEEK_SET);
+
+                    while ((n = read(in, buf, sizeof(buf))) > 0) {
+                        tail.append(buf, n);
+                    }
+
+                    ::close(in);
+                }
+            }
+
+            this->base = st;
+            this->logged = 0;
+            unlink(this->path.c_str());
+
+            if (!tail.empty() && this->create()) {
+                lock_guard<mutex> guard(this->lock);
+                this->pending.append(tail);
+                this->logged = tail.length();
+            }
+        }
+
+        // file holds all edits, drop journal
+        void remove(void) {
+            this->close();
+
+            if (!this->path.empty()) {
+                unlink(this->path.c_str());
+            }
+
+            this->logged = 0;
+        }
+
+        // flush pending records and stop flusher, journal stays on disk
+        void close(void) {
+            if (this->flusher.joinable()) {
+                {
+                    lock_guard<mutex> guard(this->lock);
+                    this->stopping = true;
+                    this->cond.notify_all();
+                }
+
+                this->flusher.join();
+                this->stopping = false;
+            }
+
+            if (this->fd != -1) {
+                ::close(this->fd);
+                this->fd = -1;
+            }
+        }
+
+    private:
+        static const size_t header_size = 8 + 4 * 8;
+        static const size_t record_size = 1 + 8 + 8 + 4;
+        static const int flush_interval = 1000;         // ms between group commits
+        static const size_t flush_bytes = 1024 * 1024;  // flush early when this much is pending
+
+        string path;
+        struct stat base;   // file edits apply to
+        int fd;             // -1 until first edit
+        size_t logged;
+
+        thread flusher;     // writes and syncs pending records, off the UI thread
+        mutex lock;         // guards pending and stopping
+        condition_variable cond;
+        string pending;
+        bool stopping;
+
+        const string header(void) const {
+            uint64_t fields[4] = {
+                (uint64_t)this->base.st_size,
+                (uint64_t)this->base.st_mtim.tv_sec,
+                (uint64_t)this->base.st_mtim.tv_nsec,
+                (uint64_t)this->base.st_ino
+            };
+
+            return string("MIMJRNL1", 8) + string((const char *)fields, sizeof(fields));
+        }
+
+        static uint32_t checksumOf(char op, uint64_t offset, uint64_t length, const char *data, size_t bytes) {
+            // FNV-1a
+            uint32_t h = 2166136261u;
+            const char *fields[3] = { &op, (const char *)&offset, (const char *)&length };
+            size_t sizes[3] = { 1, sizeof(offset), sizeof(length) };
+
+            for (int f = 0; f < 3; ++f) {
+                for (size_t i = 0; i < sizes[f]; ++i) {
+                    h = (h ^ (unsigned char)fields[f][i]) * 16777619u;
+                }
+            }
+
+            for (size_t i = 0; i < bytes; ++i) {
+                h = (h ^ (unsigned char)data[i]) * 16777619u;
+            }
+
+            return h;
+        }
+
+        bool create(void) {
+            this->fd = ::open(this->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+
+            if (this->fd == -1) {
+                return false;
+            }
+
+            string header = this->header();
+
+            if (write(this->fd, header.data(), header.length()) != (ssize_t)header.length()) {
+                ::close(this->fd);
+                this->fd = -1;
+                return false;
+            }
+
+            this->startFlusher();
+            return true;
+        }
+
+        // record goes to memory only, flusher writes it within flush_interval
+        void append(char op, uint64_t offset, uint64_t length, const char *data, size_t bytes) {
+            if (this->path.empty() || (this->fd == -1 && !this->create())) {
+                return;
+            }
+
+            uint32_t checksum = Journal::checksumOf(op, offset, length, data, bytes);
+            lock_guard<mutex> guard(this->lock);
+
+            this->pending.append(1, op);
+            this->pending.append((const char *)&offset, sizeof(offset));
+            this->pending.append((const char *)&length, sizeof(length));
+            this->pending.append((const char *)&checksum, sizeof(checksum));
+            this->pending.append(data, bytes);
+            this->logged += Journal::record_size + bytes;
+
+            if (this->pending.length() >= Journal::flush_bytes) {
+                this->cond.notify_all();
+            }
+        }
+
+        void startFlusher(void) {
+            this->flusher = thread(&Journal::flushLoop, this);
+        }
+
+        // group commit: one write and sync for all records of an interval
+        void flushLoop(void) {
+            unique_lock<mutex> guard(this->lock);
+            int interval = Journal::flush_interval;
+            string batch = "";
+
+            while (true) {
+                this->cond.wait_for(guard, chrono::milliseconds(interval), [this] {
+                    return this->stopping || this->pending.length() >= Journal::flush_bytes;
+                });
+
+                bool stop = this->stopping;
+                swap(batch, this->pending);
+                guard.unlock();
+
+                if (!batch.empty()) {
+                    size_t done = 0;
+
+                    while (done < batch.length()) {
+                        ssize_t n = write(this->fd, batch.data() + done, batch.length() - done);
+
+                        if (n == -1 && errno != EINTR) {
+                            break;  // disk full, records of this batch are lost
+                        }
+
+                        done += (n > 0) ? n : 0;
+                    }
+
+                    fdatasync(this->fd);
+                    batch.clear();
+                }
+
+                guard.lock();
+
+                if (stop) {
+                    return;
+                }
+            }
+        }
+};
+
+/*** undo ***/
+
+// edits of one undo step, recorded as ops reverting them
+// op: varint of offset delta (zigzag) with kind and spill bits, varint of length,
+// then erased bytes, inline when short, else out of line in spill buffer
+class UndoStep {
+    public:
+        struct Op {
+            bool insert;        // undone by erasing length bytes at offset
+            size_t offset;
+            size_t length;
+            const char *data;   // erased bytes (erase only), undone by inserting them
+        };
+
+        UndoStep(void) {
+            this->count = 0;
+            this->base = 0;
+            this->pending = false;
+        }
+
+        bool empty(void) const {
+            return this->count == 0 && !this->pending;
+        }
+
+        // memory held by step
+        size_t size(void) const {
+            return sizeof(UndoStep) + this->ops.capacity() + this->spill.capacity() + this->last_bytes.capacity();
+        }
+
+        // last op is extended while edits continue it (typing, backspacing)
+        void insert(size_t offset, size_t length) {
+            if (this->pending && this->last.insert && offset == this->last.offset + this->last.length) {
+                this->last.length += length;
+                return;
+            }
+
+            this->flush();
+            this->last.insert = true;
+            this->last.offset = offset;
+            this->last.length = length;
+            this->pending = true;
+        }
+
+        void erase(size_t offset, const string &bytes) {
+            size_t length = bytes.length();
+
+            if (this->pending && this->last.insert) {
+                // bytes typed in this step erased again
+                if (offset >= this->last.offset && offset + length == this->last.offset + this->last.length) {
+                    this->last.length -= length;
+                    this->pending = (this->last.length > 0);
+                    return;
+                }
+            } else if (this->pending) {
+                if (offset + length == this->last.offset) {
+                    this->last_bytes.insert(0, bytes);
+                    this->last.offset = offset;
+                    this->last.length += length;
+                    return;
+                }
+
+                if (offset == this->last.offset) {
+                    this->last_bytes.append(bytes);
+                    this->last.length += length;
+                    return;
+                }
+            }
+
+            this->flush();
+            this->last.insert = false;
+            this->last.offset = offset;
+            this->last.length = length;
+            this->last_bytes = bytes;
+            this->pending = true;
+        }
+
+        // no more ops, buffers shrunk to fit
+        void seal(void) {
+            this->flush();
+            this->ops.shrink_to_fit();
+            this->spill.shrink_to_fit();
+            string().swap(this->last_bytes);
+        }
+
+        // ops of sealed step in recorded order, data points into step
+        void decode(vector<Op> &out) const {
+            const unsigned char *p = (const unsigned char *)this->ops.data();
+            const unsigned char *end = p + this->ops.length();
+            const char *spilled = this->spill.data();
+            size_t offset = 0;
+
+            while (p < end) {
+                uint64_t head = UndoStep::getVarint(p);
+                uint64_t zigzag = head >> 2;
+                Op op;
+
+                offset += (size_t)((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+                op.insert = (head & 2) != 0;
+                op.offset = offset;
+                op.length = UndoStep::getVarint(p);
+                op.data = NULL;
+
+                if (!op.insert && (head & 1)) {
+                    op.data = spilled;
+                    spilled += op.length;
+                } else if (!op.insert) {
+                    op.data = (const char *)p;
+                    p += op.length;
+                }
+
+                out.push_back(op);
+            }
+        }
+
+    private:
+        static const size_t inline_bytes = 64;  // longer erased bytes are spilled
+
+        string ops;         // encoded ops
+        string spill;       // long erased bytes, in op order
+        size_t count;       // encoded ops
+        size_t base;        // offset of last encoded op, next one is relative to it
+
+        Op last;            // op still growing, not encoded yet
+        string last_bytes;
+        bool pending;
+
+        void flush(void) {
+            if (!this->pending) {
+                return;
+            }
+
+            int64_t delta = (int64_t)(this->last.offset - this->base);
+            uint64_t zigzag = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+            bool spilled = !this->last.insert && this->last.length > UndoStep::inline_bytes;
+
+            UndoStep::putVarint(this->ops, (zigzag << 2) | (this->last.insert ? 2 : 0) | (spilled ? 1 : 0));
+            UndoStep::putVarint(this->ops, this->last.length);
+
+            if (!this->last.insert) {
+                (spilled ? this->spill : this->ops).append(this->last_bytes);
+            }
+
+            this->base = this->last.offset;
+            this->last_bytes.clear();
+            this->pending = false;
+            ++this->count;
+        }
+
+        static void putVarint(string &out, uint64_t value) {
+            while (value >= 0x80) {
+                out.push_back((char)(value | 0x80));
+                value >>= 7;
+            }
+
+            out.push_back((char)value);
+        }
+
+        static uint64_t getVarint(const unsigned char *&p) {
+            uint64_t value = 0;
+
+            for (int shift = 0; ; shift += 7) {
+                unsigned char byte = *p++;
+                value |= (uint64_t)(byte & 0x7f) << shift;
+
+                if (!(byte & 0x80)) {
+                    return value;
+                }
+            }
+        }
+};
+
+// undo and redo stacks, oldest steps dropped to stay in memory budget
+class UndoLog {
+    public:
+        UndoLog(void) {
+            this->limit = 16 * 1024 * 1024;
+            this->used = 0;
+            this->open = false;
+        }
+
+        void setLimit(size_t limit) {
+            this->limit = limit;
+            this->trim();
+        }
+
+        // edits of text go into open step, a new edit drops redo steps
+        void insert(size_t offset, size_t length) {
+            this->openStep().insert(offset, length);
+        }
+
+        void erase(size_t offset, const string &bytes) {
+            this->openStep().erase(offset, bytes);
+        }
+
+        // following edits form a new step
+        void close(void) {
+            if (!this->open) {
+                return;
+            }
+
+            UndoStep &step = this->undo_steps.back();
+            step.seal();
+            this->open = false;
+
+            if (step.empty()) {
+                this->undo_steps.pop_back();
+                return;
+            }
+
+            this->used += step.size();
+            this->trim();
+        }
+
+        bool takeUndo(UndoStep &step) {
+            return this->take(this->undo_steps, step);
+        }
+
+        bool takeRedo(UndoStep &step) {
+            return this->take(this->redo_steps, step);
+        }
+
+        void pushUndo(UndoStep &step) {
+            this->push(this->undo_steps, step);
+        }
+
+        void pushRedo(UndoStep &step) {
+            this->push(this->redo_steps, step);
+        }
+
+    private:
+        size_t limit;   // memory budget of steps (bytes)
+        size_t used;    // memory held by closed steps
+        bool open;      // last undo step still takes edits
+
+        deque<UndoStep> undo_steps;     // newest at back
+        deque<UndoStep> redo_steps;     // next to redo at back
+
+        UndoStep &openStep(void) {
+            if (!this->open) {
+                for (size_t i = 0; i < this->redo_steps.size(); ++i) {
+                    this->used -= this->redo_steps[i].size();
+                }
+
+                this->redo_steps.clear();
+                this->undo_steps.push_back(UndoStep());
+                this->open = true;
+            }
+
+            return this->undo_steps.back();
+        }
+
+        bool take(deque<UndoStep> &steps, UndoStep &step) {
+            this->close();
+
+            if (steps.empty()) {
+                return false;
+            }
+
+            this->used -= steps.back().size();
+            step = move(steps.back());
+            steps.pop_back();
+            return true;
+        }
+
+        void push(deque<UndoStep> &steps, UndoStep &step) {
+            step.seal();
+
+            if (step.empty()) {
+                return;
+            }
+
+            this->used += step.size();
+            steps.push_back(move(step));
+            this->trim();
+        }
+
+        // newest undo and redo steps are kept even over budget
+        void trim(void) {
+            size_t closed = this->undo_steps.size() - (this->open ? 1 : 0);
+
+            while (this->used > this->limit && closed > 1) {
+                this->used -= this->undo_steps.front().size();
+                this->undo_steps.pop_front();
+                --closed;
+            }
+
+            while (this->used > this->limit && this->redo_steps.size() > 1) {
+                this->used -= this->redo_steps.front().size();
+                this->redo_steps.pop_front();
+            }
+        }
+};
+
+/*** search ***/
+
+class Searcher {
+    public:
+        Searcher(void) {
+            this->literal = true;
+            this->valid = false;
+        }
+
+        // compile pattern once, reused until pattern changes
+        bool compile(const string &pattern) {
+            if (this->valid && pattern == this->pattern) {
+                return true;
+            }
+
+            this->pattern = pattern;
+            this->literal = (pattern.find_first_of(".^$|()[]{}*+?\\") == string::npos);
+            this->valid = true;
+
+            if (!this->literal) {
+                try {
+                    this->re.assign(pattern);
+                } catch (const regex_error &e) {
+                    this->valid = false;
+                }
+            }
+
+            return this->valid;
+        }
+
+        // first match in [begin, end), position and length relative to begin
+        bool find(const char *begin, const char *end, size_t &pos, size_t &len) const {
+            if (!this->valid) {
+                return false;
+            }
+
+            if (this->literal) {
+                const char *p = (const char *)memmem(begin, end - begin, this->pattern.data(), this->pattern.length());
+
+                if (p == NULL) {
+                    return false;
+                }
+
+                pos = p - begin;
+                len = this->pattern.length();
+                return true;
+            }
+
+            cmatch cm;
+
+            if (!regex_search(begin, end, cm, this->re)) {
+                return false;
+            }
+
+            pos = cm.position(0);
+            len = cm.length(0);
+            return true;
+        }
+
+        // number of matches in [begin, end) starting before stop
+        size_t count(const char *begin, const char *end, size_t stop) const {
+            size_t matches = 0;
+
+            if (!this->valid) {
+                return 0;
+            }
+
+            if (this->literal) {
+                const char *p = begin;
+                const char *limit = (stop < (size_t)(end - begin)) ? begin + stop : end;
+
+                while ((p = (const char *)memmem(p, end - p, this->pattern.data(), this->pattern.length())) != NULL && p < limit) {
+                    ++matches;
+                    p += this->pattern.length();
+                }
+
+                return matches;
+            }
+
+            for (cregex_iterator it(begin, end, this->re), last; it != last && (size_t)it->position(0) < stop; ++it) {
+                ++matches;
+            }
+
+            return matches;
+        }
+
+        // matches in [begin, end) (first one unless all) replaced by rep into out, returns replacements
+        // rep: & or \0 whole match, \1-\9 groups, \r or \n line break, \t tab, \x for other x
+        size_t replace(const char *begin, const char *end, const string &rep, bool all, string &out) const {
+            size_t replaced = 0;
+            const char *p = begin;
+            out.clear();
+
+            if (!this->valid) {
+                return 0;
+            }
+
+            if (this->literal) {
+                const char *found = NULL;
+
+                while ((found = (const char *)memmem(p, end - p, this->pattern.data(), this->pattern.length())) != NULL) {
+                    out.append(p, found);
+                    Searcher::expand(rep, found, found + this->pattern.length(), NULL, out);
+                    p = found + this->pattern.length();
+                    ++replaced;
+
+                    if (!all) {
+                        break;
+                    }
+                }
+            } else {
+                for (cregex_iterator it(begin, end, this->re), last; it != last; ++it) {
+                    const cmatch &cm = *it;
+                    out.append(p, cm[0].first);
+                    Searcher::expand(rep, cm[0].first, cm[0].second, &cm, out);
+                    p = cm[0].second;
+                    ++replaced;
+
+                    if (!all) {
+                        break;
+                    }
+                }
+            }
+
+            out.append(p, end);
+            return replaced;
+        }
+
+    private:
+        string pattern;
+        bool literal;   // no metacharacters, plain substring search
+        bool valid;
+        regex re;
+
+        static void expand(const string &rep, const char *begin, const char *end, const cmatch *groups, string &out) {
+            for (size_t i = 0; i < rep.length(); ++i) {
+                char ch = rep[i];
+
+                if (ch == '&') {
+                    out.append(begin, end);
+                } else if (ch != '\\' || i + 1 == rep.length()) {
+                    out.append(1, ch);
+                } else if ((ch = rep[++i]) == '0') {
+                    out.append(begin, end);
+                } else if (ch >= '1' && ch <= '9') {
+                    if (groups != NULL && (size_t)(ch - '0') < groups->size()) {
+                        out.append((*groups)[ch - '0'].str());
+                    }
+                } else if (ch == 'r' || ch == 'n') {
+                    out.append(1, '\n');
+                } else if (ch == 't') {
+                    out.append(1, '\t');
+                } else {
+                    out.append(1, ch);
+                }
+            }
+        }
+};
+
+/*** frame ***/
+
+struct Cell {
+    char ch;
+    unsigned char fg;   // SGR foreground (30-37), 0 for default
+    unsigned char bg;   // SGR background (40-47), 0 for default
+    bool reverse;
+
+    Cell(void) {
+        this->ch = ' ';
+        this->fg = 0;
+        this->bg = 0;
+        this->reverse = false;
+    }
+
+    bool sameAttr(const Cell &cell) const {
+        return this->fg == cell.fg && this->bg == cell.bg && this->reverse == cell.reverse;
+    }
+
+    bool operator==(const Cell &cell) const {
+        return this->ch == cell.ch && this->sameAttr(cell);
+    }
+
+    bool operator!=(const Cell &cell) const {
+        return !(*this == cell);
+    }
+
+    bool isBlank(void) const {
+        return *this == Cell();
+    }
+};
+
+// screen content as cell grid, flushed as difference from last frame
+class Frame {
+    public:
+        Frame(void) {
+            this->rows = 0;
+            this->cols = 0;
+            this->valid = false;
+            this->term_x = -1;
+            this->term_y = -1;
+            this->scroll_delta = 0;
+        }
+
+        // next flush redraws whole screen
+        void invalidate(void) {
+            this->valid = false;
+        }
+
+        // start drawing a new frame with blank cells
+        void begin(int rows, int cols) {
+            if (rows != this->rows || cols != this->cols) {
+                this->rows = rows;
+                this->cols = cols;
+                this->last.assign(rows * cols, Cell());
+                this->invalidate();
+            }
+
+            this->cells.assign(rows * cols, Cell());
+            this->pen = Cell();
+            this->x = 0;
+            this->y = 0;
+        }
+
+        // rows [top, bottom) of last frame move up by delta rows (down if negative),
+        // shifted on terminal with scrolling region so only exposed rows are written
+        void scroll(int top, int bottom, int delta) {
+            if (!this->valid || delta == 0 || abs(delta) >= bottom - top) {
+                return;
+            }
+
+            this->scroll_top = top;
+            this->scroll_bottom = bottom;
+            this->scroll_delta = delta;
+        }
+
+        void setColor(int fg, int bg) {
+            this->pen.fg = fg;
+            this->pen.bg = bg;
+        }
+
+        void setForeground(int fg) {
+            this->pen.fg = fg;
+        }
+
+        void setReverse(bool reverse) {
+            this->pen.reverse = reverse;
+        }
+
+        void resetAttr(void) {
+            this->pen = Cell();
+        }
+
+        void append(char ch) {
+            if (this->x < this->cols && this->y < this->rows) {
+                Cell &cell = this->cells[this->y * this->cols + this->x];
+                cell = this->pen;
+                cell.ch = ch;
+            }
+
+            ++this->x;
+        }
+
+        void append(const char *str, int length) {
+            for (int i = 0; i < length; ++i) {
+                this->append(str[i]);
+            }
+        }
+
+        void append(const string &str) {
+            this->append(str.c_str(), str.length());
+        }
+
+        void nextLine(void) {
+            this->x = 0;
+            ++this->y;
+        }
+
+        // append control sequences turning last frame into this one
+        void flush(string &out, int cursor_x, int cursor_y) {
+            bool hidden = false;
+
+            if (!this->valid) {
+                this->hideCursor(out, hidden);
+                this->term_attr = Cell();
+                out.append("\x1b[m\x1b[2J");
+                this->last.assign(this->rows * this->cols, Cell());
+                this->term_y = -1;
+                this->valid = true;
+            } else if (this->scroll_delta) {
+                this->hideCursor(out, hidden);
+                this->scrollRegion(out);
+            }
+
+            this->scroll_delta = 0;
+
+            for (int y = 0; y < this->rows; ++y) {
+                const Cell *now = &this->cells[y * this->cols];
+                const Cell *old = &this->last[y * this->cols];
+
+                if (equal(now, now + this->cols, old)) {
+                    continue;
+                }
+
+                // multi-byte chars may not take one column each, redraw the row
+                bool whole_row = Frame::hasWideChar(now, this->cols) || Frame::hasWideChar(old, this->cols);
+                int blank_from = this->cols;
+
+                while (blank_from > 0 && now[blank_from - 1].isBlank()) {
+                    --blank_from;
+                }
+
+                int x = 0;
+
+                while (x < this->cols) {
+                    if (!whole_row && now[x] == old[x]) {
+                        ++x;
+                        continue;
+                    }
+
+                    // run of changed cells, joined over short unchanged gaps
+                    int end = this->cols;
+
+                    if (!whole_row) {
+                        end = x + 1;
+
+                        for (int i = x + 1; i < this->cols && i - end < 4; ++i) {
+                            if (now[i] != old[i]) {
+                                end = i + 1;
+                            }
+                        }
+                    }
+
+                    // clear blank tail instead of writing spaces
+                    bool erase = (end > blank_from);
+                    int stop = erase ? max(blank_from, x) : end;
+
+                    this->hideCursor(out, hidden);
+                    this->moveTo(out, x, y);
+
+                    for (int i = x; i < stop; ++i) {
+                        this->setAttr(out, now[i]);
+                        out.append(1, now[i].ch);
+                    }
+
+                    this->term_x = stop;
+
+                    if (erase) {
+                        this->setAttr(out, Cell());
+                        out.append("\x1b[K");
+                        x = this->cols;
+                    } else {
+                        x = end;
+                    }
+                }
+            }
+
+            this->last.swap(this->cells);
+
+            if (!this->term_attr.sameAttr(Cell())) {
+                this->setAttr(out, Cell());
+            }
+
+            if (hidden || cursor_x != this->term_x || cursor_y != this->term_y) {
+                this->moveTo(out, cursor_x, cursor_y);
+            }
+
+            if (hidden) {
+                out.append("\x1b[?25h");
+            }
+        }
+
+    private:
+        int rows;
+        int cols;
+        vector<Cell> cells; // frame being drawn
+        vector<Cell> last;  // frame on terminal
+        bool valid;         // terminal shows last frame
+
+        Cell pen;           // attributes for next append
+        int x;
+        int y;
+
+        Cell term_attr;     // terminal state
+        int term_x;
+        int term_y;         // -1 for unknown
+
+        int scroll_top;     // pending scroll of last frame
+        int scroll_bottom;
+        int scroll_delta;
+
+        static bool hasWideChar(const Cell *cells, int length) {
+            for (int i = 0; i < length; ++i) {
+                if ((unsigned char)cells[i].ch >= 0x80) {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        void scrollRegion(string &out) {
+            int top = this->scroll_top;
+            int bottom = this->scroll_bottom;
+            int delta = this->scroll_delta;
+            int count = abs(delta);
+
+            // inserted lines take current background
+            this->setAttr(out, Cell());
+
+            // set scrolling region (moves cursor home), delete/insert lines at its top
+            out.append("\x1b[" + to_string(top + 1) + ";" + to_string(bottom) + "r");
+            this->term_x = 0;
+            this->term_y = 0;
+            this->moveTo(out, 0, top);
+            out.append("\x1b[" + to_string(count) + (delta > 0 ? "M" : "L"));
+            out.append("\x1b[r");
+            this->term_x = 0;
+            this->term_y = 0;
+
+            vector<Cell>::iterator begin = this->last.begin() + top * this->cols;
+            vector<Cell>::iterator end = this->last.begin() + bottom * this->cols;
+
+            if (delta > 0) {
+                copy(begin + count * this->cols, end, begin);
+                fill(end - count * this->cols, end, Cell());
+            } else {
+                copy_backward(begin, end - count * this->cols, end);
+                fill(begin, begin + count * this->cols, Cell());
+            }
+        }
+
+        void hideCursor(string &out, bool &hidden) {
+            if (!hidden) {
+                out.append("\x1b[?25l");
+                hidden = true;
+            }
+        }
+
+        void moveTo(string &out, int x, int y) {
+            if (x == this->term_x && y == this->term_y) {
+                return;
+            }
+
+            if (y == this->term_y && this->term_y != -1 && x > this->term_x) {
+                out.append("\x1b[" + to_string(x - this->term_x) + "C");
+            } else if (y == this->term_y + 1 && this->term_y != -1 && x == 0) {
+                out.append("\r\n");
+            } else {
+                out.append("\x1b[" + to_string(y + 1) + ";" + to_string(x + 1) + "H");
+            }
+
+            this->term_x = x;
+            this->term_y = y;
+        }
+
+        void setAttr(string &out, const Cell &cell) {
+            if (cell.sameAttr(this->term_attr)) {
+                return;
+            }
+
+            if (cell.reverse == this->term_attr.reverse && cell.bg == this->term_attr.bg) {
+                out.append("\x1b[" + to_string(cell.fg ? cell.fg : 39) + "m");
+            } else {
+                out.append("\x1b[0");
+
+                if (cell.reverse) {
+                    out.append(";7");
+                }
+
+                if (cell.fg) {
+                    out.append(";" + to_string(cell.fg));
+                }
+
+                if (cell.bg) {
+                    out.append(";" + to_string(cell.bg));
+                }
+
+                out.append("m");
+            }
+
+            this->term_attr = cell;
+        }
+};
+
+/*** grammars ***/
+
+enum KeywordKind {
+    KEYWORD_NONE = 0,
+    KEYWORD_TYPE,
+    KEYWORD_STATEMENT
+};
+
+struct Keyword {
+    const char *name;
+    KeywordKind kind;
+};
+
+constexpr size_t keywordLength(const char *name) {
+    size_t length = 0;
+
+    while (name[length]) {
+        ++length;
+    }
+
+    return length;
+}
+
+// perfect hash of keywords, seed searched at compile time
+class KeywordTable {
+    public:
+        static constexpr int size = 128;    // power of 2
+
+        constexpr KeywordTable(const Keyword *keywords, int num_keywords)
+            : keywords(keywords), num_keywords(num_keywords), slots(), seed(0), max_length(0) {
+            for (int i = 0; i < num_keywords; ++i) {
+                size_t length = keywordLength(keywords[i].name);
+                this->max_length = (length > this->max_length) ? length : this->max_length;
+            }
+
+            for (this->seed = 1; !this->fill(); ++this->seed) {
+            }
+        }
+
+        constexpr unsigned int hash(const char *str, size_t length) const {
+            unsigned int h = this->seed;
+
+            for (size_t i = 0; i < length; ++i) {
+                h = (h ^ (unsigned char)str[i]) * 16777619u;
+            }
+
+            return (h ^ (h >> 15)) & (KeywordTable::size - 1);
+        }
+
+        // kind of keyword spelled by [str, str + length)
+        KeywordKind find(const char *str, size_t length) const {
+            if (length == 0 || length > this->max_length) {
+                return KEYWORD_NONE;
+            }
+
+            int slot = this->slots[this->hash(str, length)] - 1;
+
+            if (slot < 0 || keywordLength(this->keywords[slot].name) != length
+                    || memcmp(this->keywords[slot].name, str, length) != 0) {
+                return KEYWORD_NONE;
+            }
+
+            return this->keywords[slot].kind;
+        }
+
+    private:
+        const Keyword *keywords;
+        int num_keywords;
+        signed char slots[KeywordTable::size];  // keyword index + 1, 0 for empty
+        unsigned int seed;
+        size_t max_length;
+
+        // place all keywords with current seed, false on collision
+        constexpr bool fill(void) {
+            for (int i = 0; i < KeywordTable::size; ++i) {
+                this->slots[i] = 0;
+            }
+
+            for (int i = 0; i < this->num_keywords; ++i) {
+                unsigned int h = this->hash(this->keywords[i].name, keywordLength(this->keywords[i].name));
+
+                if (this->slots[h]) {
+                    return false;
+                }
+
+                this->slots[h] = i + 1;
+            }
+
+            return true;
+        }
+};
+
+// table-driven lexer of one language, built at compile time
+// byte -> class, (state, class) -> state, state -> highlight; state at end of row is carried to next row
+class Grammar {
+    public:
+        static constexpr int max_states = 32;
+        static constexpr int max_classes = 16;
+
+        // transition flags, stored above state number
+        static constexpr unsigned char state_mask = 0x1f;
+        static constexpr unsigned char backfill = 0x20;     // previous byte takes color of new state
+        static constexpr unsigned char word_end = 0x40;     // word before this byte may be a keyword
+        static constexpr unsigned char word_begin = 0x80;   // set by finish()
+
+        constexpr Grammar(const char *name, const Keyword *keywords, int num_keywords)
+            : name(name), classes(), table(), colors(), words(), carries(), keyword_colors(), keywords(keywords, num_keywords) {
+        }
+
+        /* builder */
+
+        constexpr void classify(const char *chars, int cls) {
+            for (int i = 0; chars[i]; ++i) {
+                this->classify(chars[i], cls);
+            }
+        }
+
+        constexpr void classify(char ch, int cls) {
+            this->classes[(unsigned char)ch] = cls;
+        }
+
+        constexpr void classifyRange(char first, char last, int cls) {
+            for (int ch = (unsigned char)first; ch <= (unsigned char)last; ++ch) {
+                this->classes[ch] = cls;
+            }
+        }
+
+        // word states collect keywords, words start after leaving other states
+        constexpr void state(int state, char color, bool word) {
+            this->colors[state] = color;
+            this->words[state] = word;
+        }
+
+        // state next row starts from when row ends in state (default 0)
+        constexpr void carry(int state, int next_row) {
+            this->carries[state] = next_row;
+        }
+
+        constexpr void on(int from, int cls, int to, unsigned char flags) {
+            this->table[from][cls] = to | flags;
+        }
+
+        constexpr void on(int from, int cls, int to) {
+            this->on(from, cls, to, 0);
+        }
+
+        constexpr void all(int from, int to) {
+            for (int cls = 0; cls < Grammar::max_classes; ++cls) {
+                this->on(from, cls, to);
+            }
+        }
+
+        constexpr void copy(int from, int like) {
+            for (int cls = 0; cls < Grammar::max_classes; ++cls) {
+                this->table[from][cls] = this->table[like][cls];
+            }
+        }
+
+        constexpr void keywordColors(char type, char statement) {
+            this->keyword_colors[KEYWORD_TYPE] = type;
+            this->keyword_colors[KEYWORD_STATEMENT] = statement;
+        }
+
+        constexpr void finish(void) {
+            for (int from = 0; from < Grammar::max_states; ++from) {
+                for (int cls = 0; cls < Grammar::max_classes; ++cls) {
+                    unsigned char &entry = this->table[from][cls];
+
+                    if (!this->words[from] && this->words[entry & Grammar::state_mask]) {
+                        entry |= Grammar::word_begin;
+                    }
+                }
+            }
+        }
+
+        /* lexer */
+
+        const char *getName(void) const {
+            return this->name;
+        }
+
+        // colors of [text, text + length) into hl, returns start state of next row
+        unsigned char highlight(const char *text, size_t length, unsigned char state, char *hl) const {
+            size_t begin = 0;
+
+            for (size_t i = 0; i < length; ++i) {
+                unsigned char entry = this->table[state][this->classes[(unsigned char)text[i]]];
+                state = entry & Grammar::state_mask;
+                hl[i] = this->colors[state];
+
+                if (entry & (Grammar::backfill | Grammar::word_end | Grammar::word_begin)) {
+                    if (entry & Grammar::word_end) {
+                        this->colorKeyword(text, begin, i, hl);
+                    }
+
+                    if (entry & Grammar::word_begin) {
+                        begin = i;
+                    }
+
+                    if ((entry & Grammar::backfill) && i > 0) {
+                        hl[i - 1] = hl[i];
+                    }
+                }
+            }
+
+            if (this->words[state]) {
+                this->colorKeyword(text, begin, length, hl);
+            }
+
+            return this->carries[state];
+        }
+
+        // start state of next row only
+        unsigned char scan(const char *text, size_t length, unsigned char state) const {
+            for (size_t i = 0; i < length; ++i) {
+                state = this->table[state][this->classes[(unsigned char)text[i]]] & Grammar::state_mask;
+            }
+
+            return this->carries[state];
+        }
+
+    private:
+        const char *name;
+        unsigned char classes[256];
+        unsigned char table[Grammar::max_states][Grammar::max_classes];
+        char colors[Grammar::max_states];
+        bool words[Grammar::max_states];
+        unsigned char carries[Grammar::max_states];
+        char keyword_colors[3];
+        KeywordTable keywords;
+
+        void colorKeyword(const char *text, size_t begin, size_t end, char *hl) const {
+            KeywordKind kind = this->keywords.find(text + begin, end - begin);
+
+            if (kind != KEYWORD_NONE) {
+                memset(hl + begin, this->keyword_colors[kind], end - begin);
+            }
+        }
+};
+
+// grammar by file extension, else by first bytes of file (defined with grammars below)
+const Grammar *findGrammar(const string &filename, const char *head, size_t length);
+
+class Mim {
+    public:
+        enum HL {
+            plain = 0,
+            comment,
+            mlcomment,
+            keyword_type,
+            keyword_statement,
+            str,
+            number,
+            match
+        };
+
+        Mim(void) {
+            this->config.tabs_width = 4;
+            this->config.set_num = true;
+            this->config.prefetch_rows = 16;
+            this->config.cache_size = 4 * 1024 * 1024;
+            this->config.undo_size = 16 * 1024 * 1024;
+            this->config.search_count = true;
+            this->config.verbose = true;
+            this->undo_log.setLimit(this->config.undo_size);
+        }
+
+        Mim(const Mim &mim) {
+            this->set_config(mim.get_config());
+        }
+
+        Mim(const MimConfig &config) {
+            this->set_config(config);
+        }
+
+        ~Mim(void) {
+            try {
+                this->stopSave();
+                this->stopSearch();
+                this->stopHighlight();
+
+                if (!this->headless) {
+                    this->disableRawMode();
+                }
+
+                if (this->config.verbose) {
+                    fprintf(log, "=> Exit...\r\n");
+                    fclose(log);
+                }
+            } catch (const MimError &e) {
+                printf("%s\r\n", e.what());
+            }
+        }
+
+        // headless: no terminal, commands come from runScript
+        void init(bool headless = false) {
+            try {
+                this->headless = headless;
+                this->editor_state = Mim::MimState::stoped;
+                this->editor_mode = Mim::MimMode::command;
+                this->cx = 0;
+                this->cy = 0;
+                this->rx = 0;
+                this->rx_base = 0;
+                this->row_off = 0;
+                this->col_off = 0;
+                this->frame_row_off = 0;
+                this->num_rows = 0;
+                this->text.clear();
+                this->rows_cache.clear();
+                this->rows_state.clear();
+                this->hl_valid_rows = 0;
+                this->grammar = findGrammar("", NULL, 0);
+                this->screen_buffer.clear();
+                this->command_buffer.clear();
+                this->dirty_flag = false;
+                this->force_quit = false;
+                this->last_search_row = 0;
+                this->last_search_buffer = "";
+                this->last_search_rx = 0;
+                this->last_search_rlen = 0;
+                this->last_search_index = 0;
+                this->last_search_total = 0;
+                this->search_generation = 0;
+                this->search_busy = false;
+                this->search_ready = false;
+                this->search_stopping = false;
+                this->search_pipe[0] = -1;
+                this->search_pipe[1] = -1;
+                this->highlight_generation = 0;
+                this->highlight_queued = false;
+                this->highlight_running = false;
+                this->highlight_ready = false;
+                this->highlight_stopping = false;
+                this->highlight_pipe[0] = -1;
+                this->highlight_pipe[1] = -1;
+                this->highlight_version = 0;
+                this->highlight_end = 0;
+                this->save_queued = false;
+                this->save_running = false;
+                this->save_ready = false;
+                this->save_stopping = false;
+                this->save_pipe[0] = -1;
+                this->save_pipe[1] = -1;
+                this->save_written = 0;
+                this->save_total = 0;
+                this->save_pending = false;
+                this->save_journal_mark = 0;
+                this->recording = -1;
+                this->replaying = NULL;
+                this->replay_depth = 0;
+                this->replay_failed = false;
+                fill(this->marks, this->marks + 26, -1);
+                this->batch_edits = false;
+                this->global_running = false;
+
+                this->updateLastlineBuffer("");
+                this->lastline_error = false;
+                this->editor_filename = "";
+
+                if (headless) {
+                    // page motions move by a standard screen, no .log left in working directory
+                    this->config.verbose = false;
+                    this->config.screen_rows = 22;
+                    this->config.screen_cols = 80;
+                } else {
+                    this->enableRawMode();
+                    this->handleSignals();
+                    this->updateWindowSize();
+                }
+
+                if (this->config.verbose) {
+                    log = fopen(".log", "w+");
+
+                    if (log == NULL) {
+                        throw MimError("Open log file failed.");
+                    }
+
+                    fprintf(log, "=> Init...\r\n");
+                }
+            } catch (const MimError &e) {
+                throw e;
+            }
+        }
+
+        void start(void) {
+            this->editor_state = Mim::MimState::running;
+
+            while (this->editor_state == Mim::MimState::running) {
+                try {
+                    this->refreshScreen();
+                    this->refreshBuffer();
+                    this->waitInput(this->frameTimeout());
+
+                    // handle all pending keys before drawing next frame
+                    while (this->editor_state == Mim::MimState::running && !this->input_buffer.empty()) {
+                        this->processKeyPress();
+                    }
+                } catch (const MimError &e) {
+                    throw e;
+                }
+            }
+        }
+
+        void open(const char *filename) {
+            try {
+                if (filename == NULL) {
+                    return;
+                }
+
+                this->openFile(filename);
+            } catch (const MimError &e) {
+                throw e;
+            }
+        }
+
+        // run ex commands of script ("-" for stdin) on buffer without terminal, nothing drawn or lexed
+        // one command per line, leading ':' optional, '"' starts a comment line; messages go to stderr
+        // false if any command failed (every command still runs)
+        bool runScript(const char *script) {
+            FILE *in = (strcmp(script, "-") == 0) ? stdin : fopen(script, "r");
+            char *buf = NULL;
+            size_t size = 0;
+            ssize_t length;
+            int num_line = 0;
+            bool ok = true;
+
+            if (in == NULL) {
+                throw MimError("Open script file failed.");
+            }
+
+            this->editor_state = Mim::MimState::running;
+            this->batch_edits = true;
+
+            while (this->editor_state == Mim::MimState::running && (length = getline(&buf, &size, in)) != -1) {
+                string line(buf, length);
+                ++num_line;
+
+                // '\r' is kept, :normal keys may end with it
+                if (line.length() && line.back() == '\n') {
+                    line.pop_back();
+                }
+
+                size_t begin = line.find_first_not_of(" \t:");
+
+                if (begin == string::npos || line[begin] == '"') {
+                    continue;
+                }
+
+                // each command is one undo step
+                this->undo_log.close();
+                this->updateLastlineBuffer("");
+                this->lastline_error = false;
+                this->processLastlineCommand(line.substr(begin));
+
+                // file is on disk before next command
+                this->waitSave();
+                this->applySaveResult();
+
+                if (this->lastline_buffer.length()) {
+                    fprintf(stderr, "%s:%d: %s\n", script, num_line, this->lastline_buffer.c_str());
+                }
+
+                ok = ok && !this->lastline_error;
+            }
+
+            free(buf);
+
+            if (in != stdin) {
+                fclose(in);
+            }
+
+            return ok;
+        }
+
+    protected:
+        const MimConfig &get_config(void) const {
+            return this->config;
+        }
+
+        void set_config(const MimConfig &config) {
+            this->config.screen_rows = config.screen_rows;
+            this->config.screen_cols = config.screen_cols;
+            this->config.tabs_width = config.tabs_width;
+            this->config.set_num = config.set_num;
+            this->config.prefetch_rows = config.prefetch_rows;
+            this->config.cache_size = config.cache_size;
+            this->config.undo_size = config.undo_size;
+            this->undo_log.setLimit(config.undo_size);
+            this->config.search_count = config.search_count;
+            this->config.verbose = config.verbose;
+            this->config.orig_termios = config.orig_termios;
+        }
+
+    private:
+        enum MimState {
+            stoped,
+            running,
+            pending
+        };
+
+        enum MimMode {
+            command,
+            insert
+        };
+
+        enum LastlineMode {
+            normal,
+            search,
+            save
+        };
+
+        enum Direction {
+            backward = -1,
+            input,
+            forward
+        };
+
+        // lines of ex command (start with 1), current line when not given
+        struct ExRange {
+            int first;
+            int last;
+            bool given;
+        };
+
+        // ex commands, matched by any prefix of name at least abbrev long
+        struct ExCommand {
+            const char *name;
+            size_t abbrev;
+            bool range;     // takes range of lines
+            void (Mim::*run)(const ExRange &range, bool bang, const string &arg);
+        };
+
+        static const ExCommand ex_commands[];
+
+        MimState editor_state;
+        MimMode editor_mode;
+        MimConfig config;
+        const string version = "1.0.0";
+
+        int cx;      // column number in the file (start with 0) (not cursor position)
+        int cy;      // row number in the file (start with 0) (not cursor position)
+        int rx;      // rendered column number
+        int rx_base; // change according to config.set_num
+
+        int num_rows;
+        int row_off;
+        int col_off;
+        PieceTable text;                // raw text of all rows (each row terminated by '\n')
+        Journal journal;                // edits of text not saved yet, for crash recovery
+        UndoLog undo_log;               // edits of text, undone a step at a time
+        RowCache rows_cache;            // rendered rows
+        LineStates rows_state;          // lexer checkpoint of every row
+        const Grammar *grammar;         // language of file, picked on open
+        int hl_valid_rows;              // rows_state is checked for rows before it
+        RowBuffer plain_row;            // row drawn without colors until its state is known
+        static const int highlight_budget = 1024;   // rows lexed on UI thread, longer runs go to highlight thread
+
+        struct HighlightJob {
+            TextSnapshot text;
+            const Grammar *grammar;
+            int from;               // first row not checked
+            unsigned char state;    // start state of row from
+            int show_begin;         // rows [show_begin, end) are rendered too
+            int end;
+        };
+
+        struct HighlightResult {
+            unsigned int version;       // of snapshot, stale if buffer edited since
+            int from;
+            int show_begin;
+            vector<LineState> states;   // rows from from
+            vector<RowBuffer> rows;     // rows from show_begin
+        };
+
+        thread highlight_thread;        // lexes snapshots of text, off the UI thread
+        mutex highlight_lock;           // guards job, result and flags below
+        condition_variable highlight_cond;
+        HighlightJob highlight_job;
+        HighlightResult highlight_result;
+        atomic<unsigned int> highlight_generation;  // bumped by every job, stale jobs stop
+        bool highlight_queued;          // job not taken yet
+        bool highlight_running;         // job being lexed
+        bool highlight_ready;           // result not applied yet
+        bool highlight_stopping;
+        int highlight_pipe[2];          // readable when a result is ready
+        unsigned int highlight_version; // text version and end row of last job (UI thread only)
+        int highlight_end;
+
+        Frame frame;            // screen content to draw
+        int frame_row_off;      // row_off of last frame
+        string screen_buffer;   // control sequences to write
+        string command_buffer;
+        string lastline_buffer;
+
+        time_t lastline_time;   // lastline update timer
+        bool lastline_error;    // error shown since runScript last checked
+        static const time_t lastline_duration = 5;  // seconds to show lastline message
+        static const int progress_interval = 200;   // ms between frames while saving
+        static const size_t save_chunk = 1024 * 1024;   // bytes per iovec
+        static const size_t filter_chunk = 64 * 1024;   // bytes written to filter command at a time
+        static const size_t edit_gap = 4 * 1024;        // kept bytes between rows of bulk edit copied, not cut around
+        static const int max_count = 99999999;          // count prefix of commands stops growing here
+        static const int max_replay_depth = 100;        // macros run from macros (@a in @a stops here)
+
+        RingBuffer input_buffer;    // bytes read from terminal, not handled yet
+        string paste_buffer;        // text of last bracketed paste
+
+        struct Macro {
+            vector<int> keys;       // as returned by readKey
+            vector<string> pastes;  // text of each KEY_PASTE in keys
+        };
+
+        Macro macros[26];           // registers a-z
+        int marks[26];              // rows of marks a-z (set by m), -1 if not set
+        bool batch_edits;           // edited rows are invalidated, not lexed (macro replay, :g)
+        bool global_running;        // :g does not nest
+        vector<char> global_marks;  // rows left to running :g (empty otherwise), spliced with rows_state
+        WorkerPool edit_pool;       // row passes of :s and :g
+        int recording;              // register keys are recorded into, -1 if none
+        const Macro *replaying;     // macro readKey takes keys from, NULL if none
+        size_t replay_key;
+        size_t replay_paste;
+        int replay_depth;           // replays running, one inside another
+        bool replay_failed;         // nesting too deep, all running replays stop
+
+        int last_search_row;
+        string last_search_buffer;
+        Searcher searcher;              // compiled last_search_buffer, kept for n/N
+        int last_search_rx;             // match drawn over last_search_row
+        int last_search_rlen;           // 0 when no match shown
+        size_t last_search_index;       // match i/N, 0 when not counted
+        size_t last_search_total;
+        atomic<unsigned int> search_generation;  // bumped by every query, stale workers stop
+        WorkerPool search_pool;
+
+        struct SearchQuery {
+            TextSnapshot text;      // searched off the UI thread, buffer may be edited or reloaded meanwhile
+            string target;
+            int start;
+            Mim::Direction direct;
+            unsigned int generation;
+        };
+
+        struct SearchResult {
+            string target;
+            unsigned int generation;
+            bool found;
+            int row;
+            size_t pos;
+            size_t len;
+            size_t index;
+            size_t total;
+        };
+
+        thread search_thread;           // runs queries on search_pool, off the UI thread
+        mutex search_lock;              // guards query, result and flags below
+        condition_variable search_cond;
+        SearchQuery search_query;
+        SearchResult search_result;
+        bool search_busy;               // query queued or running
+        bool search_ready;              // result not applied yet
+        bool search_stopping;
+        int search_pipe[2];             // readable when a result is ready
+
+        struct SaveJob {
+            TextSnapshot text;
+            string filename;
+            string target;      // filename through symlinks
+            mode_t mode;        // if target does not exist yet
+        };
+
+        struct SaveResult {
+            unsigned int version;   // of saved snapshot
+            string filename;
+            string target;
+            bool ok;
+            size_t written;
+            long ms;
+            bool loaded;            // saved file mapped again into saved (pieces collapse into one)
+            PieceTable saved;
+        };
+
+        thread save_thread;             // writes snapshots to disk, off the UI thread
+        mutex save_lock;                // guards job, result and flags below
+        condition_variable save_cond;
+        SaveJob save_job;
+        SaveResult save_result;
+        bool save_queued;               // job not taken yet
+        bool save_running;
+        bool save_ready;                // result not applied yet
+        bool save_stopping;
+        int save_pipe[2];               // readable when a save is done
+        atomic<size_t> save_written;    // progress of running save
+        size_t save_total;              // bytes of running save (UI thread only)
+        bool save_pending;              // save started, result not applied (UI thread only)
+        size_t save_journal_mark;       // journal position of saved snapshot
+
+        bool dirty_flag;
+        bool force_quit;
+        bool headless;          // run by script without terminal (not journaled)
+
+        string editor_filename;
+        FILE *log;
+
+        /*** terminal ***/
+
+        void enableRawMode(void) {
+            if (tcgetattr(STDIN_FILENO, &(this->config.orig_termios)) == -1) {
+                throw MimError("Get terminal mode failed.");
+            }
+
+            struct termios raw = this->config.orig_termios;
+
+            // turn on raw mode
+            raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+            raw.c_oflag &= ~(OPOST);
+            raw.c_cflag |= (CS8);
+            raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+
+            // non-blocking read, waiting is done by poll
+            raw.c_cc[VMIN] = 0;
+            raw.c_cc[VTIME] = 0;
+
+            if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
+                throw MimError("Set terminal mode failed.");
+            }
+
+            // turn on bracketed paste
+            write(STDOUT_FILENO, "\x1b[?2004h", 8);
+        }
+
+        void disableRawMode(void) {
+            write(STDOUT_FILENO, "\x1b[?2004l", 8);
+
+            if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &(this->config.orig_termios)) == -1) {
+                throw MimError("Set terminal mode failed.");
+            }
+        }
+
+        void updateCursorBase(void) {
+            if (this->config.set_num) {
+                int num_rows = this->num_rows;
+                this->rx_base = 0;
+
+                do {
+                    ++this->rx_base;
+                    num_rows /= 10;
+                } while (num_rows);
+
+                ++this->rx_base; // for " " placeholder after line number
+            }
+        }
+
+        void handleSignals(void) {
+            if (signal_pipe[0] == -1) {
+                if (pipe(signal_pipe) == -1) {
+                    throw MimError("Create signal pipe failed.");
+                }
+
+                for (int i = 0; i < 2; ++i) {
+                    fcntl(signal_pipe[i], F_SETFL, fcntl(signal_pipe[i], F_GETFL) | O_NONBLOCK);
+                    fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC);
+                }
+            }
+
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = notifySignal;
+            sigemptyset(&sa.sa_mask);
+            sa.sa_flags = SA_RESTART;
+
+            if (sigaction(SIGWINCH, &sa, NULL) == -1) {
+                throw MimError("Set signal handler failed.");
+            }
+        }
+
+        void updateWindowSize(void) {
+            struct winsize ws = this->getWindowSize();
+            this->config.screen_rows = ws.ws_row - 2;   // reserve two lines for status bar and lastline mode
+            this->config.screen_cols = ws.ws_col;
+            this->frame.invalidate();
+        }
+
+        // wait for input, signal, search, highlight or save result (timeout in ms, -1 for ever), returns true if screen needs redraw
+        bool waitInput(int timeout) {
+            struct pollfd fds[5];
+            bool resized = false;
+
+            fds[0].fd = STDIN_FILENO;
+            fds[0].events = this->input_buffer.full() ? 0 : POLLIN;
+            fds[1].fd = signal_pipe[0];
+            fds[1].events = POLLIN;
+            fds[2].fd = this->search_pipe[0];  // ignored by poll while -1
+            fds[2].events = POLLIN;
+            fds[3].fd = this->highlight_pipe[0];
+            fds[3].events = POLLIN;
+            fds[4].fd = this->save_pipe[0];
+            fds[4].events = POLLIN;
+
+            if (poll(fds, 5, timeout) == -1) {
+                if (errno == EINTR) {
+                    return false;
+                }
+
+                throw MimError("Wait input failed.");
+            }
+
+            if (fds[1].revents & POLLIN) {
+                char signals[64];
+
+                while (read(signal_pipe[0], signals, sizeof(signals)) > 0) {
+                    resized = true;
+                }
+
+                this->updateWindowSize();
+            }
+
+            if (fds[2].revents & POLLIN) {
+                char done[64];
+
+                while (read(this->search_pipe[0], done, sizeof(done)) > 0) {
+                }
+
+                resized = this->applySearchResult() || resized;
+            }
+
+            if (fds[3].revents & POLLIN) {
+                char done[64];
+
+                while (read(this->highlight_pipe[0], done, sizeof(done)) > 0) {
+                }
+
+                resized = this->applyHighlightResult() || resized;
+            }
+
+            if (fds[4].revents & POLLIN) {
+                char done[64];
+
+                while (read(this->save_pipe[0], done, sizeof(done)) > 0) {
+                }
+
+                resized = this->applySaveResult() || resized;
+            }
+
+            if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (this->input_buffer.fill(STDIN_FILENO) == -1) {
+                    throw MimError("Input failed.");
+                }
+            }
+
+            return resized;
+        }
+
+        // ms until lastline message expires, -1 if none shown
+        int lastlineTimeout(void) {
+            time_t left = this->lastline_time + Mim::lastline_duration - time(NULL);
+
+            if (this->lastline_buffer.length() && left > 0) {
+                return left * 1000;
+            }
+
+            return -1;
+        }
+
+        // ms until next frame is due without input, -1 if none
+        int frameTimeout(void) {
+            int timeout = this->lastlineTimeout();
+
+            if (this->save_pending) {
+                // save progress in status bar
+                timeout = (timeout == -1 || timeout > Mim::progress_interval) ? Mim::progress_interval : timeout;
+            }
+
+            return timeout;
+        }
+
+        // true if at least count bytes are buffered, waits shortly for rest of escape sequence
+        bool pendingInput(size_t count) {
+            if (this->input_buffer.size() < count) {
+                this->waitInput(100);
+            }
+
+            return this->input_buffer.size() >= count;
+        }
+
+        // true if buffered input starts with seq (waits shortly for rest of it)
+        bool matchInput(const char *seq) {
+            size_t length = strlen(seq);
+
+            if (!this->pendingInput(length)) {
+                return false;
+            }
+
+            for (size_t i = 0; i < length; ++i) {
+                if (this->input_buffer[i] != seq[i]) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        // collect pasted text up to end of bracketed paste
+        void readPaste(void) {
+            const char *end_marker = "\x1b[201~";
+            size_t marker_length = 6;
+
+            this->paste_buffer.clear();
+
+            while (true) {
+                size_t length = this->input_buffer.size();
+                size_t safe = 0;
+
+                while (safe < length) {
+                    if (this->input_buffer[safe] == KEY_ESC) {
+                        if (length - safe < marker_length) {
+                            break;  // may be start of end marker
+                        }
+
+                        size_t i = 1;
+
+                        while (i < marker_length && this->input_buffer[safe + i] == end_marker[i]) {
+                            ++i;
+                        }
+
+                        if (i == marker_length) {
+                            this->input_buffer.copyTo(this->paste_buffer, safe);
+                            this->input_buffer.pop(safe + marker_length);
+                            return;
+                        }
+                    }
+
+                    ++safe;
+                }
+
+                this->input_buffer.copyTo(this->paste_buffer, safe);
+                this->input_buffer.pop(safe);
+
+                if (this->input_buffer.full()) {
+                    continue;
+                }
+
+                size_t before = this->input_buffer.size();
+                this->waitInput(1000);
+
+                if (this->input_buffer.size() == before) {
+                    // end marker lost, take what is left as pasted
+                    this->input_buffer.copyTo(this->paste_buffer, before);
+                    this->input_buffer.pop(before);
+                    return;
+                }
+            }
+        }
+
+        int readKey(void) {
+            if (this->replaying != NULL) {
+                return this->replayKey();
+            }
+
+            // no terminal to ask, command waiting for key is cancelled
+            if (this->headless) {
+                return KEY_ESC;
+            }
+
+            int ch = this->readInputKey();
+
+            if (this->recording != -1) {
+                Macro &macro = this->macros[this->recording];
+                macro.keys.push_back(ch);
+
+                if (ch == KEY_PASTE) {
+                    macro.pastes.push_back(this->paste_buffer);
+                }
+            }
+
+            return ch;
+        }
+
+        // next key of replayed macro, esc (cancels command) when keys run out
+        int replayKey(void) {
+            const Macro &macro = *this->replaying;
+
+            if (this->replay_key >= macro.keys.size()) {
+                return KEY_ESC;
+            }
+
+            int ch = macro.keys[this->replay_key++];
+
+            if (ch == KEY_PASTE) {
+                this->paste_buffer = macro.pastes[this->replay_paste++];
+            }
+
+            return ch;
+        }
+
+        int readInputKey(void) {
+            while (this->input_buffer.empty()) {
+                if (this->waitInput(-1)) {
+                    // redraw while waiting for key
+                    this->refreshScreen();
+                    this->refreshBuffer();
+                }
+            }
+
+            int ch = (unsigned char)this->input_buffer[0];
+
+            if (ch == KEY_ESC && this->pendingInput(3)) {
+                char seq[3];
+                seq[0] = this->input_buffer[1];
+                seq[1] = this->input_buffer[2];
+
+                if (seq[0] == '[') {
+                    if (seq[1] == '2' && this->matchInput("\x1b[200~")) {
+                        this->input_buffer.pop(6);
+                        this->readPaste();
+                        return KEY_PASTE;
+                    }
+
+                    if (seq[1] >= '0' && seq[1] <= '9') {
+                        if (!this->pendingInput(4)) {
+                            this->input_buffer.pop(1);
+                            return KEY_ESC;
+                        }
+
+                        seq[2] = this->input_buffer[3];
+                        this->input_buffer.pop(4);
+
+                        if (seq[2] == '~') {
+                            switch (seq[1]) {
+                                case '1':
+                                    return KEY_HOME;
+                                case '3':
+                                    return KEY_DEL;
+                                case '4':
+                                    return KEY_END;
+                                case '5':
+                                    return KEY_PAGE_UP;
+                                case '6':
+                                    return KEY_PAGE_DOWN;
+                                case '7':
+                                    return KEY_HOME;
+                                case '8':
+                                    return KEY_END;
+                            }
+                        }
+
+                        return KEY_ESC;
+                    } else {
+                        this->input_buffer.pop(3);
+
+                        switch (seq[1]) {
+                            case 'A':
+                                return KEY_ARROW_UP;
+                            case 'B':
+                                return KEY_ARROW_DOWN;
+                            case 'C':
+                                return KEY_ARROW_RIGHT;
+                            case 'D':
+                                return KEY_ARROW_LEFT;
+                            case 'H':
+                                return KEY_HOME;
+                            case 'F':
+                                return KEY_END;
+                            default:
+                                return KEY_ESC;
+                        }
+                    }
+                } else if (seq[0] == 'O') {
+                    this->input_buffer.pop(3);
+
+                    switch (seq[1]) {
+                        case 'H':
+                            return KEY_HOME;
+                        case 'F':
+                            return KEY_END;
+                    }
+
+                    return KEY_ESC;
+                }
+            }
+
+            this->input_buffer.pop(1);
+            return ch;
+        }
+
+        const struct winsize getWindowSize(void) {
+            struct winsize ws;
+
+            if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+                throw MimError("Get window size failed.");
+            }
+
+            return ws;
+        }
+
+        const CursorPosition getCursorPosition(void) {
+            char buf[32];
+            int row = 0;
+            int col = 0;
+
+            if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) {
+                throw MimError("Get cursor position failed.");
+            }
+
+            for (unsigned int i = 0; i < sizeof(buf) - 1; ++i) {
+                if (read(STDIN_FILENO, &buf[i], 1) != 1 || buf[i] == 'R')  {
+                    buf[i] = '\0';
+                    break;
+                }
+            }
+
+            if (buf[0] != '\x1b' || buf[1] != '[') {
+                throw MimError("Get cursor position failed.");
+            }
+
+            if (sscanf(&buf[2], "%d;%d", &row, &col) != 2) {
+                throw MimError("Get cursor position failed.");
+            }
+
+            return CursorPosition(row, col);
+        }
+
+        /*** manipulation ***/
+
+        void closeEditor(void) {
+            // save in flight may clear dirty flag
+            this->waitSave();
+            this->applySaveResult();
+
+            if (this->dirty_flag && !this->force_quit) {
+                this->updateLastlineError("[WARN] File has unsaved changes (Add '!' flag to force quit)");
+            } else {
+                // nothing left to recover (or changes dropped by '!')
+                this->journal.remove();
+                this->editor_state = Mim::MimState::stoped;
+                this->clearScreen();
+                this->refreshBuffer();
+            }
+        }
+
+        /*** input ***/
+
+        inline void keyMoveCursor(const int &key) {
+            int row_length = this->rowLength(this->cy);
+            bool end_of_line = (this->cx >= row_length);
+
+            switch (key) {
+                case KEY_ARROW_LEFT:
+                    if (this->cx != 0) {
+                        --this->cx;
+                    } else if (this->cy > 0) {
+                        --this->cy;
+                        this->keyHomeEnd(KEY_END);
+                    }
+
+                    break;
+                case KEY_ARROW_RIGHT:
+                    if (this->cx < row_length) {
+                        ++this->cx;
+                    } else if (end_of_line && this->cy < this->num_rows) {
+                        ++this->cy;
+                        this->keyHomeEnd(KEY_HOME);
+                    }
+
+                    break;
+                case KEY_ARROW_UP:
+                    if (this->cy != 0) {
+                        --this->cy;
+                    }
+
+                    if (end_of_line) {
+                        this->keyHomeEnd(KEY_END);
+                    }
+
+                    break;
+                case KEY_ARROW_DOWN:
+                    if (this->cy < this->num_rows) {
+                        ++this->cy;
+                    }
+
+                    if (end_of_line) {
+                        this->keyHomeEnd(KEY_END);
+                    }
+
+                    break;
+                default:
+                    break;
+            }
+
+            this->cx = min(this->cx, this->rowLength(this->cy));
+        }
+
+        inline void keyPageUpDown(const int &key) {
+            if (key == KEY_PAGE_UP) {
+                // to the top of screen
+                this->cy = this->row_off;
+            } else {
+                // to the bottom of screen
+                this->cy = min(this->row_off + this->config.screen_rows - 1, this->num_rows);
+            }
+
+            // then a screen further at once
+            this->moveRows(key == KEY_PAGE_UP ? -this->config.screen_rows : this->config.screen_rows);
+        }
+
+        // move cursor up (delta < 0) or down rows, stays at end of line when it was
+        inline void moveRows(int delta) {
+            bool end_of_line = (this->cx >= this->rowLength(this->cy));
+            this->cy = min(max(this->cy + delta, 0), this->num_rows);
+            this->cx = end_of_line ? this->rowLength(this->cy) : min(this->cx, this->rowLength(this->cy));
+        }
+
+        inline void keyHomeEnd(const int &key) {
+            switch (key) {
+                case KEY_HOME:
+                    this->cx = 0;
+                    break;
+                case KEY_END:
+                    this->cx = this->rowLength(this->cy);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        // count prefix of command (0 when none), ch becomes key after it
+        int readCount(int &ch) {
+            int count = 0;
+
+            while ((ch >= '1' && ch <= '9') || (ch == '0' && count > 0)) {
+                count = Mim::appendDigit(count, ch - '0');
+                ch = this->readKey();
+            }
+
+            return count;
+        }
+
+        // value with digit appended, stops growing at max_count
+        static int appendDigit(int value, int digit) {
+            value = value * 10 + digit;
+            return (value < Mim::max_count) ? value : Mim::max_count;
+        }
+
+        // where motion key repeated count times takes cursor, false when key is no motion
+        // j/k/g/G span whole rows (linewise), others end before target (exclusive)
+        bool motionTarget(int key, int count, CursorPosition &to, bool &linewise) {
+            int n = max(count, 1);
+            size_t offset = this->text.lineOffset(this->cy) + this->cx;
+
+            to.row = this->cy;
+            to.col = this->cx;
+            linewise = false;
+
+            switch (key) {
+                case 'h':
+                case '\b':
+                case KEY_ARROW_LEFT:
+                    // through line breaks, as keyMoveCursor does
+                    offset = (offset > (size_t)n) ? offset - n : 0;
+                    break;
+                case 'l':
+                case KEY_ARROW_RIGHT:
+                    offset = min(offset + n, this->text.lineOffset(this->num_rows));
+                    break;
+                case 'j':
+                case '\r':
+                case KEY_ARROW_DOWN:
+                case 'k':
+                case KEY_ARROW_UP:
+                    {
+                        bool end_of_line = (this->cx >= this->rowLength(this->cy));
+                        int delta = (key == 'k' || key == KEY_ARROW_UP) ? -n : n;
+                        to.row = min(max(this->cy + delta, 0), this->num_rows);
+                        to.col = end_of_line ? this->rowLength(to.row) : min(this->cx, this->rowLength(to.row));
+                        linewise = true;
+                        return true;
+                    }
+                case '0':
+                case KEY_HOME:
+                    to.col = 0;
+                    return true;
+                case '$':
+                case KEY_END:
+                    to.row = min(this->cy + n - 1, this->num_rows);
+                    to.col = this->rowLength(to.row);
+                    return true;
+                case 'g':
+                case 'G':
+                    // line count, or first/last line
+                    if (count) {
+                        to.row = min(count - 1, this->num_rows);
+                    } else {
+                        to.row = (key == 'g') ? 0 : this->num_rows;
+                    }
+
+                    to.col = (key == 'G' && !count) ? this->rowLength(to.row) : 0;
+                    linewise = true;
+                    return true;
+                case '{':
+                case '}':
+                    to.row = this->paragraphRow(n, (key == '}') ? Mim::Direction::forward : Mim::Direction::backward);
+                    to.col = 0;
+                    return true;
+                default:
+                    return false;
+            }
+
+            to.row = this->text.lineAt(offset);
+            to.col = offset - this->text.lineOffset(to.row);
+            return true;
+        }
+
+        // count-th blank row after (before) paragraph of cursor, or first/last row
+        int paragraphRow(int count, Mim::Direction direct) {
+            int row = this->cy;
+
+            while (count--) {
+                while (row >= 0 && row < this->num_rows && this->rowLength(row) == 0) {
+                    row += direct;
+                }
+
+                while (row >= 0 && row < this->num_rows && this->rowLength(row) != 0) {
+                    row += direct;
+                }
+
+                if (row < 0 || row >= this->num_rows) {
+                    return (direct == Mim::Direction::forward) ? this->num_rows : 0;
+                }
+            }
+
+            return row;
+        }
+
+        // operator (d: delete, c: change) on motion read after it (dd/cc: rows)
+        // whole range is one buffer operation, e.g. 100000dd
+        void applyOperator(int op, int count) {
+            int ch = this->readKey();
+            int motion_count = this->readCount(ch);
+            long long product = (long long)max(count, 1) * max(motion_count, 1);
+            int n = (count || motion_count) ? (int)min(product, (long long)Mim::max_count) : 0;
+
+            CursorPosition to;
+            bool linewise = true;
+
+            if (ch == op) {
+                to.row = min(this->cy + max(n, 1) - 1, this->num_rows);
+            } else if (!this->motionTarget(ch, n, to, linewise)) {
+                return;
+            }
+
+            size_t begin = 0;
+            size_t end = 0;
+
+            if (linewise) {
+                int first = min(this->cy, to.row);
+                int last = max(this->cy, to.row);
+                begin = this->text.lineOffset(first);
+
+                // change keeps an empty row
+                if (op == 'c') {
+                    end = this->text.lineOffset(last) + this->rowLength(last);
+                } else {
+                    end = this->text.lineOffset(last + 1);
+                }
+            } else {
+                size_t from = this->text.lineOffset(this->cy) + this->cx;
+                size_t target = this->text.lineOffset(to.row) + to.col;
+                begin = min(from, target);
+                end = max(from, target);
+            }
+
+            this->eraseRange(begin, end);
+            this->cy = this->text.lineAt(begin);
+            this->cx = begin - this->text.lineOffset(this->cy);
+
+            if (op == 'c') {
+                this->enterInsertMode();
+            }
+        }
+
+        // delete count chars from cursor, in row
+        void delChars(int count) {
+            size_t offset = this->text.lineOffset(this->cy) + this->cx;
+            int length = min(max(count, 1), this->rowLength(this->cy) - this->cx);
+
+            if (length > 0) {
+                this->eraseRange(offset, offset + length);
+            }
+        }
+
+        // keys read from now on until q go into register (a-z), not while replaying (replayed keys are not recorded)
+        void recordMacro(int reg) {
+            if (reg < 'a' || reg > 'z' || this->replaying != NULL) {
+                return;
+            }
+
+            this->recording = reg - 'a';
+            this->macros[this->recording] = Macro();
+        }
+
+        // run keys of register count times, frame drawn once after all of them
+        void replayMacro(int reg, int count) {
+            if (reg < 'a' || reg > 'z') {
+                return;
+            }
+
+            if (this->macros[reg - 'a'].keys.empty()) {
+                this->updateLastlineError(string("Register @") + (char)reg + " is empty");
+                return;
+            }
+
+            this->replayKeys(this->macros[reg - 'a'], count);
+        }
+
+        // keys of macro handled count times as if typed, replay running (:normal or @b in @a) goes on after
+        void replayKeys(const Macro &macro, int count) {
+            if (this->replay_depth >= Mim::max_replay_depth) {
+                this->updateLastlineError("Macros nested too deep");
+                this->replay_failed = true;
+                return;
+            }
+
+            // recording q... @a ... q keeps @a, not keys it runs
+            int recording = this->recording;
+            bool batch_edits = this->batch_edits;
+            const Macro *replaying = this->replaying;
+            size_t replay_key = this->replay_key;
+            size_t replay_paste = this->replay_paste;
+            this->recording = -1;
+            this->replaying = &macro;
+            this->batch_edits = true;
+            ++this->replay_depth;
+
+            for (int i = max(count, 1); i > 0 && this->editor_state == Mim::MimState::running && !this->replay_failed; --i) {
+                this->replay_key = 0;
+                this->replay_paste = 0;
+
+                while (this->replay_key < macro.keys.size() && this->editor_state == Mim::MimState::running
+                        && !this->replay_failed) {
+                    this->processKeyPress();
+                }
+            }
+
+            // outermost replay clears failure for next one
+            if (--this->replay_depth == 0) {
+                this->replay_failed = false;
+            }
+            this->replaying = replaying;
+            this->replay_key = replay_key;
+            this->replay_paste = replay_paste;
+            this->recording = recording;
+            this->batch_edits = batch_edits;
+        }
+
+        inline void enterCommandMode(void) {
+            this->editor_mode = Mim::MimMode::command;
+        }
+
+        inline void enterInsertMode(void) {
+            this->updateLastlineBuffer("-- INSERT --");
+            this->editor_mode = Mim::MimMode::insert;
+        }
+
+        void processKeyPressInCommandMode(int ch) {
+            // edits of each command (with insert mode it enters) are one undo step
+            this->undo_log.close();
+
+            // count prefix, e.g. 5dd, 10000j
+            int count = this->readCount(ch);
+            CursorPosition to;
+            bool linewise = false;
+
+            switch (ch) {
+                // insert
+                case 'A':
+                    this->keyHomeEnd(KEY_END);
+                    this->enterInsertMode();
+                    break;
+                case 'I':
+                    this->keyHomeEnd(KEY_HOME);
+                    this->enterInsertMode();
+                    break;
                 case 'o':
                     this->insertRow(this->cy + 1, "");
                     this->keyMoveCursor(KEY_ARROW_DOWN);
@@ -586,895 +3860,3258 @@ class Mim {
                     break;
                     // delete
                 case 'c':
-                    this->keyMoveCursor(KEY_ARROW_RIGHT);
-                    this->delChar();
+                case 'd':
+                    this->applyOperator(ch, count);
+                    break;
+                case 's':
+                    this->delChars(count);
                     this->enterInsertMode();
                     break;
-                case 'd':
-                    this->keyMoveCursor(KEY_ARROW_RIGHT);
-                    this->delChar();
+                case 'x':
+                    this->delChars(count);
+                    break;
+                    // modify:
+                case 'r':
+                    {
+                        int key = this->readKey();
+                        this->keyMoveCursor(KEY_ARROW_RIGHT);
+                        this->delChar();
+                        this->insertChar(key);
+                        break;
+                    }
+                case 'u':
+                case KEY_CTRL('r'):
+                    for (int i = max(count, 1); i > 0; --i) {
+                        this->undoStep(ch == KEY_CTRL('r'));
+                    }
+
+                    break;
+                    // change mode
+                case 'i':
+                    this->enterInsertMode();
+                    break;
+                case ':':
+                    {
+                        string lastline_command = this->getLastlineFromInput(Mim::LastlineMode::normal);
+                        processLastlineCommand(lastline_command);
+                        break;
+                    }
+                case '/':
+                    this->getLastlineFromInput(Mim::LastlineMode::search);
+                    break;
+                case 'n':
+                    this->searchText(this->last_search_buffer, Mim::Direction::forward);
+                    break;
+                case 'N':
+                    this->searchText(this->last_search_buffer, Mim::Direction::backward);
+                    break;
+                case 'q':
+                    if (this->recording != -1) {
+                        // q ending recording is no key of macro
+                        if (!this->macros[this->recording].keys.empty()) {
+                            this->macros[this->recording].keys.pop_back();
+                        }
+                        this->recording = -1;
+                    } else {
+                        this->recordMacro(this->readKey());
+                    }
+
+                    break;
+                case '@':
+                    this->replayMacro(this->readKey(), count);
+                    break;
+                case 'm':
+                    {
+                        int key = this->readKey();
+
+                        if (key >= 'a' && key <= 'z') {
+                            this->marks[key - 'a'] = this->cy;
+                        }
+
+                        break;
+                    }
+                case KEY_PASTE:
+                    this->insertText(this->paste_buffer);
+                    break;
+                    // movement (motions in motionTarget)
+                case KEY_CTRL('u'):
+                    this->keyPageUpDown(KEY_PAGE_UP);
+                    break;
+                case KEY_CTRL('d'):
+                    this->keyPageUpDown(KEY_PAGE_DOWN);
+                    break;
+                default:
+                    if (this->motionTarget(ch, count, to, linewise)) {
+                        this->cy = to.row;
+                        this->cx = to.col;
+                    }
+
+                    break;
+            }
+        }
+
+        void processKeyPressInInsertMode(const int &ch) {
+            switch (ch) {
+                case KEY_ESC:
+                    // "-- INSERT --" goes with insert mode
+                    this->updateLastlineBuffer("");
+                    this->enterCommandMode();
+                    break;
+                case KEY_CTRL('q'):
+                    // TODO
+                    break;
+                case KEY_ARROW_LEFT:
+                case KEY_ARROW_RIGHT:
+                case KEY_ARROW_UP:
+                case KEY_ARROW_DOWN:
+                    this->keyMoveCursor(ch);
+                    break;
+                case KEY_PAGE_UP:
+                case KEY_PAGE_DOWN:
+                    this->keyPageUpDown(ch);
+                    break;
+                case KEY_HOME:
+                case KEY_END:
+                    this->keyHomeEnd(ch);
+                    break;
+                case '\r':
+                    this->insertNewline();
+                    break;
+                case '\b':
+                case KEY_DEL:
+                    if (ch == KEY_DEL) {
+                        this->keyMoveCursor(KEY_ARROW_RIGHT);
+                    }
+
+                    this->delChar();
+                    break;
+                case KEY_CTRL('l'):
+                    // TODO
+                    break;
+                case KEY_CTRL('s'):
+                    this->saveToFile();
+                    break;
+                case KEY_PASTE:
+                    this->insertText(this->paste_buffer);
+                    break;
+                default:
+                    this->insertChar(ch);
+                    break;
+            }
+        }
+
+        string getLastlineFromInput(Mim::LastlineMode mode) {
+            int orig_cx = this->cx;
+            int orig_cy = this->cy;
+            int orig_col_off = this->col_off;
+            int orig_row_off = this->row_off;
+
+            string prompt = "";
+            string lastline_command = "";
+
+            switch (mode) {
+                case Mim::LastlineMode::normal:
+                    prompt = ":";
+                    break;
+                case Mim::LastlineMode::search:
+                    prompt = "/";
+                    break;
+                case Mim::LastlineMode::save:
+                    prompt = "Save as: ";
+                    break;
+                default:
+                    break;
+            }
+
+            while (true) {
+                this->updateLastlineBuffer(prompt + lastline_command);
+
+                if (this->input_buffer.empty()) {
+                    this->refreshScreen();
+                    this->refreshBuffer();
+                }
+
+                int ch = this->readKey();
+
+                if (ch == '\b') {
+                    if (lastline_command.length()) {
+                        lastline_command = lastline_command.substr(0, lastline_command.length() - 1);
+                    }
+                } else if (ch == KEY_ESC) {
+                    if (mode == Mim::LastlineMode::search) {
+                        this->cancelSearch();
+                        this->dropSearchMatch(0, this->num_rows);
+                    }
+
+                    lastline_command = "";
+                    this->cx = orig_cx ;
+                    this->cy = orig_cy ;
+                    this->col_off = orig_col_off ;
+                    this->row_off = orig_row_off ;
+                    break;
+                } else if (ch == '\r') {
+                    if (lastline_command.length()) {
+                        if (mode == Mim::LastlineMode::search) {
+                            // land on match of final pattern
+                            this->waitSearch();
+                            this->applySearchResult();
+                        }
+
+                        break;
+                    }
+                } else if (ch == KEY_PASTE) {
+                    // first pasted line only
+                    for (size_t i = 0; i < this->paste_buffer.length() && !iscntrl(this->paste_buffer[i]); ++i) {
+                        lastline_command.append(1, this->paste_buffer[i]);
+                    }
+                } else if (!iscntrl(ch) && ch < 128) {
+                    lastline_command.append(string(1, ch));
+                }
+
+                if (mode == Mim::LastlineMode::search) {
+                    this->startSearch(lastline_command, Mim::Direction::input);
+                }
+            }
+
+            return lastline_command;
+        }
+
+        // [range]name[!] [arg], e.g. :1,$d  :.,+100m0  :'a,'bt$  :wq!
+        void processLastlineCommand(const string &command) {
+            ExRange range;
+            size_t pos = 0;
+
+            if (this->parseRange(command, pos, range)) {
+                this->runExCommand(command, pos, range);
+            }
+
+            this->enterCommandMode();
+        }
+
+        void runExCommand(const string &command, size_t pos, const ExRange &range) {
+            while (pos < command.length() && command[pos] == ' ') {
+                ++pos;
+            }
+
+            size_t begin = pos;
+
+            while (pos < command.length() && isalpha(command[pos])) {
+                ++pos;
+            }
+
+            // :!cmd, ! is a name of its own
+            if (pos == begin && pos < command.length() && command[pos] == '!') {
+                ++pos;
+            }
+
+            string name = command.substr(begin, pos - begin);
+            bool bang = (pos < command.length() && command[pos] == '!');
+            pos += bang ? 1 : 0;
+
+            while (pos < command.length() && command[pos] == ' ') {
+                ++pos;
+            }
+
+            string arg = command.substr(pos);
+
+            // :n jumps to line
+            if (name.empty() && !bang && arg.empty()) {
+                if (range.given) {
+                    this->keyHomeEnd(KEY_HOME);
+                    this->cy = min(max(range.last - 1, 0), this->num_rows);
+                }
+
+                return;
+            }
+
+            const ExCommand *ex = Mim::findExCommand(name);
+
+            if (ex == NULL) {
+                this->updateLastlineError("Not an editor command: " + command);
+            } else if (range.given && !ex->range) {
+                this->updateLastlineError("No range allowed");
+            } else if (Mim::needsLines(ex, range) && (range.first < 1 || range.last > this->num_rows)) {
+                this->updateLastlineError("Invalid range");
+            } else {
+                (this->*ex->run)(range, bang, arg);
+            }
+        }
+
+        // :normal and :! without range run on cursor row (may be the empty one after last line) or on none
+        static bool needsLines(const ExCommand *ex, const ExRange &range) {
+            return ex->range && (range.given || (ex->run != &Mim::exNormal && ex->run != &Mim::exFilter));
+        }
+
+        static const ExCommand *findExCommand(const string &name) {
+            for (const ExCommand *ex = Mim::ex_commands; ex->name != NULL; ++ex) {
+                if (name.length() >= ex->abbrev && string(ex->name).compare(0, name.length(), name) == 0) {
+                    return ex;
+                }
+            }
+
+            return NULL;
+        }
+
+        // [addr][,addr] or %, addresses after ';' are relative to the one before it
+        bool parseRange(const string &command, size_t &pos, ExRange &range) {
+            int current = this->cy + 1;
+            int line = 0;
+            bool given = false;
+
+            range.first = range.last = current;
+            range.given = false;
+
+            if (pos < command.length() && command[pos] == '%') {
+                ++pos;
+                range.first = 1;
+                range.last = this->num_rows;
+                range.given = true;
+                return true;
+            }
+
+            // last two of addresses separated by ',' or ';', missing ones are current line
+            for (int slots = 0; ; ++slots) {
+                if (!this->parseAddress(command, pos, current, line, given)) {
+                    return false;
+                }
+
+                line = given ? line : current;
+                range.first = (slots > 0) ? range.last : line;
+                range.last = line;
+                range.given = range.given || given || slots > 0;
+
+                if (pos >= command.length() || (command[pos] != ',' && command[pos] != ';')) {
+                    break;
+                }
+
+                if (command[pos++] == ';') {
+                    current = line;
+                }
+            }
+
+            if (range.given && range.first > range.last) {
+                swap(range.first, range.last);
+            }
+
+            return true;
+        }
+
+        // n . $ 'x (mark), followed by +n -n, or offsets alone (from current line)
+        bool parseAddress(const string &command, size_t &pos, int current, int &line, bool &given) {
+            size_t length = command.length();
+            given = true;
+
+            if (pos < length && isdigit(command[pos])) {
+                line = 0;
+
+                while (pos < length && isdigit(command[pos])) {
+                    line = Mim::appendDigit(line, command[pos++] - '0');
+                }
+            } else if (pos < length && command[pos] == '.') {
+                line = current;
+                ++pos;
+            } else if (pos < length && command[pos] == '$') {
+                line = this->num_rows;
+                ++pos;
+            } else if (pos < length && command[pos] == '\'') {
+                char mark = (pos + 1 < length) ? command[pos + 1] : '\0';
+
+                if (mark < 'a' || mark > 'z' || this->marks[mark - 'a'] == -1) {
+                    this->updateLastlineError("Mark not set");
+                    return false;
+                }
+
+                line = this->marks[mark - 'a'] + 1;
+                pos += 2;
+            } else if (pos < length && (command[pos] == '+' || command[pos] == '-')) {
+                line = current;
+            } else {
+                given = false;
+                return true;
+            }
+
+            while (pos < length && (command[pos] == '+' || command[pos] == '-')) {
+                int sign = (command[pos++] == '+') ? 1 : -1;
+                int offset = isdigit(command[pos]) ? 0 : 1;
+
+                while (pos < length && isdigit(command[pos])) {
+                    offset = Mim::appendDigit(offset, command[pos++] - '0');
+                }
+
+                line += sign * offset;
+            }
+
+            // past last line is checked by commands (:n jumps to last line)
+            if (line < 0) {
+                this->updateLastlineError("Invalid range");
+                return false;
+            }
+
+            return true;
+        }
+
+        // address taken by :m and :t (0 is before first line)
+        bool parseTarget(const string &arg, int &line) {
+            size_t pos = 0;
+            bool given = false;
+
+            if (!this->parseAddress(arg, pos, this->cy + 1, line, given)) {
+                return false;
+            }
+
+            if (!given || pos != arg.length() || line > this->num_rows) {
+                this->updateLastlineError("Invalid address");
+                return false;
+            }
+
+            return true;
+        }
+
+        void exDelete(const ExRange &range, bool, const string &) {
+            this->eraseRange(this->text.lineOffset(range.first - 1), this->text.lineOffset(range.last));
+            this->cy = min(range.first - 1, this->num_rows);
+            this->cx = 0;
+            this->reportLines(range.last - range.first + 1, "fewer lines");
+        }
+
+        // lines copied below target line, one insert
+        void exCopy(const ExRange &range, bool, const string &arg) {
+            int target = 0;
+
+            if (!this->parseTarget(arg, target)) {
+                return;
+            }
+
+            string lines = "";
+            this->text.read(this->text.lineOffset(range.first - 1), this->text.lineOffset(range.last), lines);
+            this->insertRange(this->text.lineOffset(target), lines);
+            this->cy = target + (range.last - range.first);
+            this->cx = 0;
+            this->reportLines(range.last - range.first + 1, "more lines");
+        }
+
+        // lines moved below target line, one erase and one insert
+        void exMove(const ExRange &range, bool, const string &arg) {
+            int target = 0;
+            int count = range.last - range.first + 1;
+
+            if (!this->parseTarget(arg, target)) {
+                return;
+            }
+
+            if (target >= range.first && target < range.last) {
+                this->updateLastlineError("Cannot move a range of lines into itself");
+                return;
+            }
+
+            string lines = "";
+            this->text.read(this->text.lineOffset(range.first - 1), this->text.lineOffset(range.last), lines);
+            this->eraseRange(this->text.lineOffset(range.first - 1), this->text.lineOffset(range.last));
+
+            if (target >= range.last) {
+                target -= count;
+            }
+
+            this->insertRange(this->text.lineOffset(target), lines);
+            this->cy = target + count - 1;
+            this->cx = 0;
+            this->reportLines(count, "lines moved");
+        }
+
+        void exWrite(const ExRange &, bool bang, const string &) {
+            this->force_quit = this->force_quit || bang;
+            this->saveToFile();
+        }
+
+        void exQuit(const ExRange &, bool bang, const string &) {
+            this->force_quit = this->force_quit || bang;
+            this->closeEditor();
+        }
+
+        void exWriteQuit(const ExRange &range, bool bang, const string &arg) {
+            this->exWrite(range, bang, arg);
+            this->exQuit(range, bang, arg);
+        }
+
+        // normal keys, as typed in command mode (once on each line of range, cursor at its start)
+        // incomplete command is cancelled, insert mode left at end
+        void exNormal(const ExRange &range, bool, const string &arg) {
+            if (range.given) {
+                if (this->global_running) {
+                    this->updateLastlineError("Cannot do :normal with range in :global");
+                    return;
+                }
+
+                this->globalEach(range.first - 1, vector<char>(range.last - range.first + 1, 1), "normal " + arg);
+                return;
+            }
+
+            Macro macro;
+            Macro esc;
+
+            for (size_t i = 0; i < arg.length(); ++i) {
+                macro.keys.push_back((unsigned char)arg[i]);
+            }
+
+            esc.keys.push_back(KEY_ESC);
+            this->replayKeys(macro, 1);
+
+            if (this->editor_mode == Mim::MimMode::insert) {
+                this->replayKeys(esc, 1);
+            }
+        }
+
+        // [range]!command: lines replaced by output of command they are piped through,
+        // without range command just runs and its last line of output is shown
+        void exFilter(const ExRange &range, bool, const string &arg) {
+            if (arg.empty()) {
+                this->updateLastlineError("Argument required");
+                return;
+            }
+
+            int first = range.first - 1;
+            size_t begin = range.given ? this->text.lineOffset(first) : 0;
+            size_t end = range.given ? this->text.lineOffset(range.last) : 0;
+            string output = "";
+            int status = this->runFilter(arg, begin, end, output);
+
+            if (status != 0 || !range.given) {
+                size_t stop = output.find_last_not_of('\n');
+                size_t start = (stop == string::npos) ? 0 : output.rfind('\n', stop) + 1;
+                string last_line = (stop == string::npos) ? "" : output.substr(start, stop - start + 1);
+
+                if (status != 0) {
+                    // range kept, output is most likely an error
+                    this->updateLastlineError("shell returned " + to_string(status) + (last_line.empty() ? "" : ": " + last_line));
+                } else {
+                    this->updateLastlineBuffer(last_line);
+                }
+
+                return;
+            }
+
+            string old = "";
+            this->text.read(begin, end, old);
+
+            // rows end with '\n', last one of output too
+            if (!output.empty() && output.back() != '\n') {
+                output.append(1, '\n');
+            }
+
+            int lines = count(output.begin(), output.end(), '\n');
+            this->replaceText(begin, old, output);
+
+            this->eraseStates(first, range.last - first);
+            this->insertStates(first, lines);
+            this->num_rows += lines - (range.last - first);
+            this->invalidateHighlight(first);
+            this->invalidateRows(first);
+            this->dirty_flag = this->dirty_flag || (old != output);
+
+            this->cy = first;
+            this->cx = 0;
+            this->reportLines(range.last - first, "lines filtered");
+        }
+
+        // run command by sh, bytes [begin, end) of text are written to its stdin while its stdout (and stderr)
+        // is read into output, on non-blocking pipes neither side waits for the other; returns exit status
+        int runFilter(const string &command, size_t begin, size_t end, string &output) {
+            TextSnapshot snapshot = this->text.snapshot();
+            int in[2];
+            int out[2];
+
+            if (pipe(in) == -1) {
+                throw MimError("Create filter pipe failed.");
+            }
+
+            if (pipe(out) == -1) {
+                close(in[0]);
+                close(in[1]);
+                throw MimError("Create filter pipe failed.");
+            }
+
+            // command that stops reading fails write with EPIPE, not kills editor
+            signal(SIGPIPE, SIG_IGN);
+
+            posix_spawn_file_actions_t actions;
+            posix_spawnattr_t attr;
+            sigset_t defaults;
+            const char *argv[] = { "sh", "-c", command.c_str(), NULL };
+            pid_t pid;
+
+            sigemptyset(&defaults);
+            sigaddset(&defaults, SIGPIPE);
+            posix_spawnattr_init(&attr);
+            posix_spawnattr_setsigdefault(&attr, &defaults);
+            posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+            posix_spawn_file_actions_init(&actions);
+            posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+            posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+            posix_spawn_file_actions_adddup2(&actions, out[1], STDERR_FILENO);
+            posix_spawn_file_actions_addclose(&actions, in[1]);
+            posix_spawn_file_actions_addclose(&actions, out[0]);
+
+            int error = posix_spawn(&pid, "/bin/sh", &actions, &attr, (char *const *)argv, environ);
+            posix_spawn_file_actions_destroy(&actions);
+            posix_spawnattr_destroy(&attr);
+            close(in[0]);
+            close(out[1]);
+
+            if (error != 0) {
+                close(in[1]);
+                close(out[0]);
+                throw MimError("Run filter command failed.");
+            }
+
+            int to = in[1];
+            int from = out[0];
+            string scratch = "";
+            const char *pending = NULL;
+            size_t pending_length = 0;
+            char buf[64 * 1024];
+
+            fcntl(to, F_SETFL, fcntl(to, F_GETFL) | O_NONBLOCK);
+            fcntl(from, F_SETFL, fcntl(from, F_GETFL) | O_NONBLOCK);
+
+            while (from != -1) {
+                if (to != -1 && pending_length == 0 && begin == end) {
+                    // eof of command input
+                    close(to);
+                    to = -1;
+                }
+
+                struct pollfd fds[2];
+                fds[0].fd = to;     // ignored by poll while -1
+                fds[0].events = POLLOUT;
+                fds[1].fd = from;
+                fds[1].events = POLLIN;
+
+                if (poll(fds, 2, -1) == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+
                     break;
-                    // modify:
-                case 'r':
-                    {
-                        int key = this->readKey();
-                        this->keyMoveCursor(KEY_ARROW_RIGHT);
-                        this->delChar();
-                        this->insertChar(key);
+                }
+
+                if (fds[0].revents) {
+                    // next piece of range, copied only where it crosses pieces
+                    if (pending_length == 0) {
+                        size_t next = min(begin + Mim::filter_chunk, end);
+                        pending = snapshot.span(begin, next, scratch);
+                        pending_length = next - begin;
+                        begin = next;
+                    }
+
+                    ssize_t n = write(to, pending, pending_length);
+
+                    if (n > 0) {
+                        pending += n;
+                        pending_length -= n;
+                    } else if (n == -1 && errno != EAGAIN && errno != EINTR) {
+                        // command does not read rest
+                        pending_length = 0;
+                        begin = end;
+                    }
+                }
+
+                if (fds[1].revents) {
+                    ssize_t n = read(from, buf, sizeof(buf));
+
+                    if (n > 0) {
+                        output.append(buf, n);
+                    } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                        close(from);
+                        from = -1;
+                    }
+                }
+            }
+
+            if (to != -1) {
+                close(to);
+            }
+
+            if (from != -1) {
+                close(from);
+            }
+
+            int status = 0;
+
+            while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+            }
+
+            return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        }
+
+        // s/pattern/replacement/[g]
+        void exSubstitute(const ExRange &range, bool, const string &arg) {
+            this->substitute(range.first - 1, range.last, arg, NULL);
+        }
+
+        // g/pattern/command, on every line when no range
+        void exGlobal(const ExRange &range, bool bang, const string &arg) {
+            this->global(range, bang, arg);
+        }
+
+        // v/pattern/command, lines not matching
+        void exVglobal(const ExRange &range, bool, const string &arg) {
+            this->global(range, true, arg);
+        }
+
+        // text up to unescaped delim, pos moves past delim ("\delim" is delim)
+        static string delimited(const string &arg, size_t &pos, char delim) {
+            string text = "";
+
+            while (pos < arg.length() && arg[pos] != delim) {
+                if (arg[pos] == '\\' && pos + 1 < arg.length()) {
+                    if (arg[pos + 1] != delim) {
+                        text.append(1, '\\');
+                    }
+
+                    ++pos;
+                }
+
+                text.append(1, arg[pos++]);
+            }
+
+            pos += (pos < arg.length()) ? 1 : 0;
+            return text;
+        }
+
+        // rows per task of row passes, small ranges stay on one thread
+        int editChunk(int rows) {
+            return max(4096, rows / (this->edit_pool.size() * 8) + 1);
+        }
+
+        // visit rows [first, last) of snapshot as func(row, raw, length), bytes of all rows spanned at once
+        template<typename Func>
+        static void forEachLine(const TextSnapshot &snapshot, int first, int last, Func func) {
+            string scratch = "";
+            size_t begin = snapshot.lineOffset(first);
+            size_t end = snapshot.lineOffset(last - 1) + snapshot.lineLength(last - 1);
+            const char *raw = snapshot.span(begin, end, scratch);
+            const char *stop = raw + (end - begin);
+
+            for (int row = first; row < last; ++row) {
+                const char *eol = (const char *)memchr(raw, '\n', stop - raw);
+                eol = (eol == NULL) ? stop : eol;
+                func(row, raw, eol - raw);
+                raw = eol + 1;
+            }
+        }
+
+        // substitute in rows [first, last) (marked ones only, unless marked is NULL)
+        // pattern compiled once, rows matched across workers, then changed rows rewritten bottom up
+        void substitute(int first, int last, const string &arg, const vector<char> *marked) {
+            struct Substitution {
+                int row;
+                string line;
+                size_t count;
+            };
+
+            if (arg.empty() || isalnum(arg[0]) || isspace(arg[0]) || arg[0] == '\\') {
+                this->updateLastlineError("Usage: :[range]s/pattern/replacement/[g]");
+                return;
+            }
+
+            size_t pos = 1;
+            string pattern = Mim::delimited(arg, pos, arg[0]);
+            string rep = Mim::delimited(arg, pos, arg[0]);
+            string flags = arg.substr(pos);
+            Searcher searcher;
+
+            if (flags != "" && flags != "g") {
+                this->updateLastlineError("Trailing characters: " + flags);
+                return;
+            }
+
+            if (pattern.empty() || !searcher.compile(pattern)) {
+                this->updateLastlineError("Invalid pattern: " + pattern);
+                return;
+            }
+
+            TextSnapshot snapshot = this->text.snapshot();
+            int chunk = this->editChunk(last - first);
+            int tasks = (last - first + chunk - 1) / chunk;
+            vector<vector<Substitution>> changes(tasks);
+            bool all = (flags == "g");
+
+            this->edit_pool.run(tasks, [&](int task) {
+                string line = "";
+                int from = first + task * chunk;
+
+                Mim::forEachLine(snapshot, from, min(from + chunk, last), [&](int row, const char *raw, size_t length) {
+                    if (marked != NULL && !(*marked)[row - first]) {
+                        return;
+                    }
+
+                    size_t count = searcher.replace(raw, raw + length, rep, all, line);
+
+                    if (count) {
+                        changes[task].push_back(Substitution{row, line, count});
+                    }
+                });
+            });
+
+            vector<Substitution> changed;
+            size_t total = 0;
+
+            for (int task = 0; task < tasks; ++task) {
+                for (size_t i = 0; i < changes[task].size(); ++i) {
+                    changed.push_back(Substitution());
+                    swap(changed.back(), changes[task][i]);
+                    total += changed.back().count;
+                }
+            }
+
+            if (total == 0) {
+                this->updateLastlineError("Pattern not found: " + pattern);
+                return;
+            }
+
+            // each run of changed rows (less than edit_gap bytes apart) rewritten as one edit, bottom up
+            // (offsets of snapshot hold above), rows between runs are not touched
+            int top = changed.front().row;
+            int bottom = changed.back().row;
+            vector<int> breaks(changed.size(), 0);
+
+            for (size_t end = changed.size(); end > 0; ) {
+                size_t start = end - 1;
+
+                while (start > 0 && snapshot.lineOffset(changed[start].row)
+                        - snapshot.lineOffset(changed[start - 1].row + 1) < Mim::edit_gap) {
+                    --start;
+                }
+
+                int run_top = changed[start].row;
+                int run_bottom = changed[end - 1].row;
+                size_t begin = snapshot.lineOffset(run_top);
+                string old = "";
+                string str = "";
+                size_t at = 0;
+                size_t next = start;
+
+                snapshot.read(begin, snapshot.lineOffset(run_bottom) + snapshot.lineLength(run_bottom), old);
+                str.reserve(old.length());
+
+                for (int row = run_top; row <= run_bottom; ++row) {
+                    size_t eol = min(old.find('\n', at), old.length());
+
+                    if (row == changed[next].row) {
+                        str.append(changed[next].line);
+                        breaks[next] = count(changed[next].line.begin(), changed[next].line.end(), '\n');
+                        ++next;
+                    } else {
+                        str.append(old, at, eol - at);
+                    }
+
+                    if (row < run_bottom) {
+                        str.append(1, '\n');
+                    }
+
+                    at = eol + 1;
+                }
+
+                this->replaceText(begin, old, str);
+                end = start;
+            }
+
+            // changed rows are lexed and rendered again, rows split by '\n' in replacement get new states
+            int added = 0;
+
+            for (size_t i = 0; i < changed.size(); ++i) {
+                this->rows_state[changed[i].row] = LineState();
+                this->rows_cache.erase(changed[i].row);
+                added += breaks[i];
+            }
+
+            if (added) {
+                // bottom up, rows of earlier changes keep their numbers
+                for (size_t i = changed.size(); i-- > 0; ) {
+                    this->insertStates(changed[i].row + 1, breaks[i]);
+                }
+
+                this->num_rows += added;
+                this->invalidateRows(top);
+            } else {
+                this->dropSearchMatch(top, bottom);
+            }
+
+            this->invalidateHighlight(top);
+            this->dirty_flag = true;
+
+            // last substituted row
+            this->cy = bottom + added - breaks.back();
+            this->cx = 0;
+            this->updateLastlineBuffer(to_string(total) + (total == 1 ? " substitution" : " substitutions") +
+                " on " + to_string(changed.size()) + (changed.size() == 1 ? " line" : " lines"));
+        }
+
+        // marked[i]: row first + i matches (invert: does not), rows split across workers
+        size_t matchRows(const Searcher &searcher, int first, int last, bool invert, vector<char> &marked) {
+            TextSnapshot snapshot = this->text.snapshot();
+            int chunk = this->editChunk(last - first);
+            int tasks = (last - first + chunk - 1) / chunk;
+            atomic<size_t> matched(0);
+
+            marked.assign(last - first, 0);
+
+            this->edit_pool.run(tasks, [&](int task) {
+                size_t task_matched = 0;
+                size_t pos = 0;
+                size_t len = 0;
+                int from = first + task * chunk;
+
+                Mim::forEachLine(snapshot, from, min(from + chunk, last), [&](int row, const char *raw, size_t length) {
+                    if (searcher.find(raw, raw + length, pos, len) != invert) {
+                        marked[row - first] = 1;
+                        ++task_matched;
+                    }
+                });
+
+                matched += task_matched;
+            });
+
+            return matched;
+        }
+
+        // :d and :s on matched rows run as one pass, other commands once per matched row,
+        // rows are found by flag in global_marks which moves with them on edits
+        void global(const ExRange &range, bool invert, const string &arg) {
+            if (this->global_running) {
+                this->updateLastlineError("Cannot do :global recursive");
+                return;
+            }
+
+            if (arg.empty() || isalnum(arg[0]) || isspace(arg[0]) || arg[0] == '\\') {
+                this->updateLastlineError("Usage: :[range]g/pattern/command");
+                return;
+            }
+
+            int first = range.given ? range.first - 1 : 0;
+            int last = range.given ? range.last : this->num_rows;
+            size_t pos = 1;
+            string pattern = Mim::delimited(arg, pos, arg[0]);
+            string command = arg.substr(pos);
+            Searcher searcher;
+            vector<char> marked;
+
+            if (pattern.empty() || !searcher.compile(pattern)) {
+                this->updateLastlineError("Invalid pattern: " + pattern);
+                return;
+            }
+
+            size_t matched = this->matchRows(searcher, first, last, invert, marked);
+
+            if (matched == 0) {
+                this->updateLastlineError("Pattern not found: " + pattern);
+                return;
+            }
+
+            size_t name_end = 0;
+
+            while (name_end < command.length() && isalpha(command[name_end])) {
+                ++name_end;
+            }
+
+            const ExCommand *ex = Mim::findExCommand(command.substr(0, name_end));
+
+            if (command.empty()) {
+                this->updateLastlineBuffer(to_string(matched) + " matching lines");
+            } else if (ex != NULL && ex->run == &Mim::exDelete && name_end == command.length()) {
+                this->deleteRows(first, marked);
+            } else if (ex != NULL && ex->run == &Mim::exSubstitute) {
+                this->substitute(first, last, command.substr(name_end), &marked);
+            } else {
+                this->globalEach(first, marked, command);
+            }
+        }
+
+        // command run with cursor on each marked row, top down
+        void globalEach(int first, const vector<char> &marked, const string &command) {
+            this->global_marks.assign(this->num_rows, 0);
+            copy(marked.begin(), marked.end(), this->global_marks.begin() + first);
+
+            bool batch_edits = this->batch_edits;
+            this->batch_edits = true;
+            this->global_running = true;
+
+            for (int row = first; row < (int)this->global_marks.size() && this->editor_state == Mim::MimState::running; ) {
+                if (!this->global_marks[row]) {
+                    ++row;
+                    continue;
+                }
+
+                ExRange range;
+                size_t pos = 0;
+                this->global_marks[row] = 0;
+                this->cy = row;
+                this->cx = 0;
+
+                // row may now hold next marked row (rows above it deleted)
+                if (this->parseRange(command, pos, range)) {
+                    this->runExCommand(command, pos, range);
+                }
+            }
+
+            this->global_marks.clear();
+            this->global_marks.shrink_to_fit();
+
+            this->batch_edits = batch_edits;
+            this->global_running = false;
+        }
+
+        // delete marked rows (from first) in one undo step: one edit per run of marked rows (less than
+        // edit_gap bytes apart, rows kept between copied), bottom up; rows kept between runs are not touched
+        void deleteRows(int first, const vector<char> &marked) {
+            int top = find(marked.begin(), marked.end(), 1) - marked.begin();
+            int bottom = marked.rend() - find(marked.rbegin(), marked.rend(), 1);
+            int deleted = 0;
+
+            for (int i = bottom; i > top; ) {
+                int end = i;
+                size_t stop = this->text.lineOffset(first + end);
+                string old = "";
+                string str = "";
+
+                // marked rows of run, then kept rows above it while gap is short
+                while (i > top) {
+                    int kept = i;
+
+                    while (i > top && marked[i - 1]) {
+                        --i;
+                    }
+
+                    this->eraseStates(first + i, kept - i);
+                    deleted += kept - i;
+                    kept = i;
+
+                    while (i > top && !marked[i - 1]) {
+                        --i;
+                    }
+
+                    if (i == top || this->text.lineOffset(first + kept) - this->text.lineOffset(first + i) >= Mim::edit_gap) {
+                        i = kept;
                         break;
                     }
-                    // change mode
-                case 'i':
-                    this->enterInsertMode();
-                    break;
-                case ':':
-                    {
-                        string lastline_command = this->getLastlineFromInput(Mim::LastlineMode::normal);
-                        processLastlineCommand(lastline_command);
+                }
+
+                size_t begin = this->text.lineOffset(first + i);
+                this->text.read(begin, stop, old);
+
+                for (size_t at = 0, row = first + i; at < old.length(); ++row) {
+                    size_t eol = old.find('\n', at) + 1;
+
+                    if (!marked[row - first]) {
+                        str.append(old, at, eol - at);
+                    }
+
+                    at = eol;
+                }
+
+                this->replaceText(begin, old, str);
+
+                while (i > top && !marked[i - 1]) {
+                    --i;
+                }
+            }
+
+            bottom = first + bottom - 1;
+            this->num_rows -= deleted;
+            this->invalidateHighlight(first);
+            this->invalidateRows(first);
+            this->dirty_flag = true;
+
+            // row of last deletion
+            int above = 0;
+
+            for (int row = first; row < bottom; ++row) {
+                above += marked[row - first];
+            }
+
+            this->cy = min(bottom - above, this->num_rows);
+            this->cx = 0;
+            this->reportLines(deleted, "fewer lines");
+        }
+
+        // bulk commands tell what they did to more than a couple of lines
+        void reportLines(int count, const string &what) {
+            if (count > 2) {
+                this->updateLastlineBuffer(to_string(count) + " " + what);
+            }
+        }
+
+        void processKeyPress(void) {
+            try {
+                int ch = this->readKey();
+
+                switch (this->editor_mode) {
+                    case Mim::MimMode::command:
+                        this->processKeyPressInCommandMode(ch);
+                        break;
+                    case Mim::MimMode::insert:
+                        this->processKeyPressInInsertMode(ch);
+                        break;
+                    default:
                         break;
+                }
+
+            } catch (const MimError &e) {
+                throw e;
+            }
+        }
+
+        /*** output ***/
+        inline void refreshBuffer(void) {
+            if (this->headless) {
+                this->screen_buffer.clear();
+                return;
+            }
+
+            write(STDOUT_FILENO, this->screen_buffer.c_str(), this->screen_buffer.length());
+
+            if (this->config.verbose) {
+                fprintf(log, "=> Frame: %zu bytes written\r\n", this->screen_buffer.length());
+            }
+
+            this->screen_buffer.clear();
+        }
+
+        inline void scroll(void) {
+            this->rx = this->rx_base;
+
+            // get rx from cx
+            if (this->cy < this->num_rows) {
+                this->rx = cx2rx(this->getRow(this->cy), this->cx);
+            }
+
+            // up
+            if (this->cy < this->row_off) {
+                this->row_off = this->cy;
+            }
+
+            // down
+            if (this->cy >= this->row_off + this->config.screen_rows) {
+                this->row_off = this->cy - this->config.screen_rows + 1;
+            }
+
+            // left
+            if (this->rx - this->rx_base < this->col_off) {
+                this->col_off = this->rx - this->rx_base;
+            }
+
+            // right
+            if (this->rx >= this->col_off + this->config.screen_cols) {
+                this->col_off = this->rx - this->config.screen_cols + 1;
+            }
+        }
+
+        inline void showVersion(void) {
+            string welcome_msg = "Mim Editor -- version " + this->version;
+            int padding = (this->config.screen_cols - welcome_msg.length()) / 2;
+
+            if (padding) {
+                this->frame.append("~");
+                --padding;
+            }
+
+            while (padding--) {
+                this->frame.append(" ");
+            }
+
+            this->frame.append(welcome_msg);
+        }
+
+        inline void drawLineNumber(int file_row) {
+            string file_row_string = to_string(file_row + 1);
+
+            this->frame.setColor(30, 47);
+
+            if (this->cy == file_row) {
+                this->frame.setColor(33, 40);
+            }
+
+            for (int length = (int)file_row_string.length(); length < (this->rx_base - 1); ++length) {
+                this->frame.append(" ");
+            }
+
+            this->frame.append(file_row_string);
+            this->frame.append(" ");
+            this->frame.resetAttr();
+        }
+
+        inline void drawRows(void) {
+            for (int y = 0, rows = this->num_rows, maxrows = this->config.screen_rows; y < maxrows; ++y) {
+                int file_row = y + row_off;
+
+                if (file_row >= rows) {
+                    // draw '~' placeholder or version
+                    if (rows == 0 && y == maxrows / 3) {
+                        this->showVersion();
+                    } else {
+                        this->frame.append("~");
                     }
-                case '/':
-                    this->getLastlineFromInput(Mim::LastlineMode::search);
-                    break;
-                case 'n':
-                    this->searchText(this->last_search_buffer, Mim::Direction::forward);
-                    break;
-                case 'N':
-                    this->searchText(this->last_search_buffer, Mim::Direction::backward);
-                    break;
-                case 'q':
-                    // TODO
-                    break;
-                    // movement
-                case 'h':
-                case '\b':
-                    this->keyMoveCursor(KEY_ARROW_LEFT);
-                    break;
-                case 'j':
-                case '\r':
-                    this->keyMoveCursor(KEY_ARROW_DOWN);
-                    break;
-                case 'k':
-                    this->keyMoveCursor(KEY_ARROW_UP);
-                    break;
-                case 'l':
-                    this->keyMoveCursor(KEY_ARROW_RIGHT);
-                    break;
-                case 'g':
-                    this->cx = 0;
-                    this->cy = 0;
-                    break;
-                case 'G':
-                    this->cy = this->num_rows;
-                    this->keyHomeEnd(KEY_END);
-                    break;
-                case KEY_ARROW_LEFT:
-                case KEY_ARROW_RIGHT:
-                case KEY_ARROW_UP:
-                case KEY_ARROW_DOWN:
-                    this->keyMoveCursor(ch);
-                    break;
-                case KEY_CTRL('u'):
-                    this->keyPageUpDown(KEY_PAGE_UP);
-                    break;
-                case KEY_CTRL('d'):
-                    this->keyPageUpDown(KEY_PAGE_DOWN);
-                    break;
-                case '0':
-                    this->keyHomeEnd(KEY_HOME);
+                } else {
+                    if (this->config.set_num) {
+                        this->drawLineNumber(file_row);
+                    }
+
+                    // draw text data from files
+                    const RowBuffer &row = this->getRow(file_row);
+                    int length = row.render.length() - this->col_off;
+
+                    if (length > 0) {
+                        length = min(length, this->config.screen_cols - this->rx_base);
+                        const char *render_row = row.render.c_str() + this->col_off;
+                        const char *hl = row.hl.c_str() + this->col_off;
+                        int match_begin = -1;
+                        int match_end = -1;
+
+                        if (file_row == this->last_search_row && this->last_search_rlen > 0) {
+                            match_begin = this->last_search_rx - this->col_off;
+                            match_end = match_begin + this->last_search_rlen;
+                        }
+
+                        for (int i = 0; i < length; ++i) {
+                            if (i >= match_begin && i < match_end) {
+                                this->frame.setForeground(this->syntax2color(Mim::HL::match));
+                            } else if (hl[i] == Mim::HL::plain) {
+                                this->frame.setForeground(0);
+                            } else {
+                                this->frame.setForeground(this->syntax2color((Mim::HL)hl[i]));
+                            }
+
+                            this->frame.append(render_row[i]);
+                        }
+
+                        this->frame.setForeground(0);
+                    }
+                }
+
+                this->frame.nextLine();
+            }
+        }
+
+        inline void drawStatusBar(void) {
+            string status = "";
+
+            switch (this->editor_mode) {
+                case Mim::MimMode::command:
+                    status += "COMMAND | ";
                     break;
-                case '$':
-                    this->keyHomeEnd(KEY_END);
+                case Mim::MimMode::insert:
+                    status += "INSERT | ";
                     break;
                 default:
                     break;
             }
+
+            string filename = (this->editor_filename == "") ? "[No Name]" : this->editor_filename;
+            status += (filename + " - " + to_string(this->num_rows) + " lines ");
+            string modified = (this->dirty_flag) ? "(modified)" : "";
+            status += modified;
+
+            if (this->save_pending) {
+                size_t percent = (this->save_total > 0) ? this->save_written * 100 / this->save_total : 100;
+                status += (status.back() == ' ' ? "" : " ");
+                status += ("saving " + to_string(percent) + "%");
+            }
+
+            if (this->recording != -1) {
+                status += (status.back() == ' ' ? "" : " ");
+                status += (string("recording @") + (char)('a' + this->recording));
+            }
+
+            if (this->last_search_rlen > 0 && this->last_search_total > 0) {
+                status += (status.back() == ' ' ? "" : " ");
+                status += ("match " + to_string(this->last_search_index) + "/" + to_string(this->last_search_total));
+            }
+            int length = min((int)status.length(), this->config.screen_cols);
+            string rstatus = (to_string(this->cy + 1) + "/" + to_string(this->num_rows));
+            int rlength = min((int)rstatus.length(), this->config.screen_cols);
+
+            this->frame.setReverse(true);
+            this->frame.append(status.c_str(), length);
+
+            for (int i = length, cols = this->config.screen_cols; i < cols; ++i) {
+                if (cols - i == rlength) {
+                    this->frame.append(rstatus);
+                    break;
+                } else {
+                    this->frame.append(" ");
+                }
+            }
+
+            this->frame.resetAttr();
+            this->frame.nextLine();
+        }
+
+        inline void updateLastlineBuffer(const string &lastline) {
+            this->lastline_buffer.clear();
+            this->lastline_buffer.append(lastline);
+            this->lastline_time = time(NULL);
+        }
+
+        // failed command, script run exits with nonzero status
+        inline void updateLastlineError(const string &lastline) {
+            this->updateLastlineBuffer(lastline);
+            this->lastline_error = true;
+        }
+
+        inline void drawLastline(void) {
+            int length = min((int)this->lastline_buffer.length(), this->config.screen_cols);
+
+            if (length && time(NULL) - this->lastline_time < Mim::lastline_duration) {
+                this->frame.append(this->lastline_buffer.c_str(), length);
+            }
+        }
+
+        inline void resetCursor(void) {
+            this->screen_buffer.append("\x1b[H");  // move cursor to line 1 column 1
+        }
+
+        inline void clearScreen(void) {
+            this->screen_buffer.append("\x1b[2J"); // clear whole screen
+            this->resetCursor();
+            this->frame.invalidate();
+        }
+
+        // render rows around screen ahead of scrolling, evict the rest beyond budget
+        inline void prefetchRows(void) {
+            int begin = max(this->row_off - this->config.prefetch_rows, 0);
+            int end = min(this->row_off + this->config.screen_rows + this->config.prefetch_rows, this->num_rows);
+
+            for (int i = begin; i < end; ++i) {
+                this->getRow(i);
+            }
         }
 
-        void processKeyPressInInsertMode(const int &ch) {
-            switch (ch) {
-                case KEY_ESC:
-                    this->enterCommandMode();
-                    break;
-                case KEY_CTRL('q'):
-                    // TODO
-                    break;
-                case KEY_ARROW_LEFT:
-                case KEY_ARROW_RIGHT:
-                case KEY_ARROW_UP:
-                case KEY_ARROW_DOWN:
-                    this->keyMoveCursor(ch);
-                    break;
-                case KEY_PAGE_UP:
-                case KEY_PAGE_DOWN:
-                    this->keyPageUpDown(ch);
-                    break;
-                case KEY_HOME:
-                case KEY_END:
-                    this->keyHomeEnd(ch);
-                    break;
-                case '\r':
-                    this->insertNewline();
-                    break;
-                case '\b':
-                case KEY_DEL:
-                    if (ch == KEY_DEL) {
-                        this->keyMoveCursor(KEY_ARROW_RIGHT);
-                    }
+        inline void trimRowsCache(void) {
+            this->rows_cache.trim(this->config.cache_size, this->row_off, this->row_off + this->config.screen_rows);
+        }
 
-                    this->delChar();
-                    break;
-                case KEY_CTRL('l'):
-                    // TODO
-                    break;
-                case KEY_CTRL('s'):
-                    this->saveToFile();
-                    break;
-                default:
-                    this->insertChar(ch);
-                    break;
+        inline void refreshScreen(void) {
+            // one frame after macro replay, none without terminal
+            if (this->replaying != NULL || this->headless) {
+                return;
             }
+
+            this->updateCursorBase();
+            this->scroll();
+            this->prefetchRows();
+            this->frame.begin(this->config.screen_rows + 2, this->config.screen_cols);
+            this->frame.scroll(0, this->config.screen_rows, this->row_off - this->frame_row_off);
+            this->frame_row_off = this->row_off;
+            this->drawRows();
+            this->trimRowsCache();
+            this->drawStatusBar();
+            this->drawLastline();
+            this->frame.flush(this->screen_buffer, this->rx - this->col_off, this->cy - this->row_off);
         }
 
-        string getLastlineFromInput(Mim::LastlineMode mode) {
-            int orig_cx = this->cx;
-            int orig_cy = this->cy;
-            int orig_col_off = this->col_off;
-            int orig_row_off = this->row_off;
+        /*** translation ***/
+        // last tab before cx by binary search, O(1) for rows without tabs
+        int cx2rx(const RowBuffer &row, int cx) {
+            vector<TabStop>::const_iterator tab = lower_bound(row.tabs.begin(), row.tabs.end(), cx,
+                [](const TabStop &stop, int cx) { return stop.cx < cx; });
+            int rx = cx;
+
+            if (tab != row.tabs.begin()) {
+                --tab;
+                rx = tab->rx + (cx - tab->cx - 1);
+            }
 
-            string prompt = "";
-            string lastline_command = "";
+            // prevent space calculation from rx_base
+            rx += this->rx_base;
 
-            switch (mode) {
-                case Mim::LastlineMode::normal:
-                    prompt = ":";
-                    break;
-                case Mim::LastlineMode::search:
-                    prompt = "/";
-                    break;
-                case Mim::LastlineMode::save:
-                    prompt = "Save as: ";
-                    break;
+            return rx;
+        }
+
+        // byte of raw drawn at rendered column rx
+        int rx2cx(const RowBuffer &row, int rx) {
+            vector<TabStop>::const_iterator tab = upper_bound(row.tabs.begin(), row.tabs.end(), rx,
+                [](int rx, const TabStop &stop) { return rx < stop.rx; });
+            int cx = rx;
+
+            if (tab != row.tabs.begin()) {
+                cx = (tab - 1)->cx + 1 + (rx - (tab - 1)->rx);
+            }
+
+            // column inside spaces of next tab
+            if (tab != row.tabs.end() && cx >= tab->cx) {
+                return tab->cx;
+            }
+
+            return min(cx, (int)row.raw.length());
+        }
+
+        int syntax2color(Mim::HL hl) {
+            // syntax theme config
+            switch (hl) {
+                case Mim::HL::comment:
+                case Mim::HL::mlcomment:
+                    return 36;
+                case Mim::HL::keyword_type:
+                    return 31;
+                case Mim::HL::keyword_statement:
+                    return 32;
+                case Mim::HL::str:
+                    return 35;
+                case Mim::HL::number:
+                    return 33;
+                case Mim::HL::match:
+                    return 34;
                 default:
-                    break;
+                    return 37;
+            }
+        }
+
+        // tabs expanded to spaces, runs between them copied at once
+        void raw2render(RowBuffer &row) {
+            const string &raw = row.raw;
+            size_t pos = 0;
+            size_t tab;
+
+            row.render.clear();
+            row.tabs.clear();
+            row.render.reserve(raw.length());
+
+            while ((tab = raw.find('\t', pos)) != string::npos) {
+                row.render.append(raw, pos, tab - pos);
+                row.render.append(this->config.tabs_width - row.render.length() % this->config.tabs_width, ' ');
+                row.tabs.push_back(TabStop{(int)tab, (int)row.render.length()});
+                pos = tab + 1;
+            }
+
+            row.render.append(raw, pos, string::npos);
+        }
+
+        const string render2hl(const string &render, int idx) {
+            string hl(render.length(), Mim::HL::plain);
+            unsigned char start = this->startState(idx);
+            unsigned char end = this->grammar->highlight(render.data(), render.length(), start, &hl[0]);
+
+            this->rows_state[idx] = LineState(start, end);
+
+            return hl;
+        }
+
+        /*** row operations ***/
+        inline int rowLength(int num_row) {
+            return (num_row < this->num_rows) ? (int)this->text.lineLength(num_row) : 0;
+        }
+
+        RowBuffer &updateRow(int num_row) {
+            if (!this->updateHighlightState(num_row)) {
+                // lexed again once rows before it are
+                this->rows_state[num_row] = LineState();
+                this->rows_cache.erase(num_row);
+                return this->plainRow(num_row);
+            }
+
+            unsigned char next_state = this->rows_state[num_row].end;
+            RowBuffer row(this->text.line(num_row));
+            this->raw2render(row);
+            row.hl = this->render2hl(row.render, num_row);
+
+            if (num_row >= this->hl_valid_rows) {
+                this->hl_valid_rows = num_row + 1;
+            } else if (next_state != this->rows_state[num_row].end) {
+                // following rows are lexed again up to first unchanged one
+                this->invalidateHighlight(num_row + 1);
+            }
+
+            return this->rows_cache.put(num_row, row);
+        }
+
+        RowBuffer &getRow(int num_row) {
+            if (this->headless || !this->updateHighlightState(num_row)) {
+                return this->plainRow(num_row);
+            }
+
+            RowBuffer *row = this->rows_cache.find(num_row);
+
+            if (row != NULL && this->checkState(num_row)) {
+                return *row;
+            }
+
+            return this->updateRow(num_row);
+        }
+
+        // row without colors, not cached
+        RowBuffer &plainRow(int num_row) {
+            RowBuffer row(this->text.line(num_row));
+            this->raw2render(row);
+            row.hl.assign(row.render.length(), Mim::HL::plain);
+            swap(this->plain_row, row);
+            return this->plain_row;
+        }
+
+        // row edited in place: rendered now, or dropped in batch of edits (drawn once at end)
+        void touchRow(int num_row) {
+            if (this->batch_edits) {
+                this->rows_cache.erase(num_row);
+                this->invalidateHighlight(num_row);
+                return;
+            }
+
+            this->updateRow(num_row);
+        }
+
+        // drop rendered rows from num_row (row numbers shifted)
+        void invalidateRows(int num_row) {
+            this->rows_cache.eraseFrom(num_row);
+            this->dropSearchMatch(num_row, this->num_rows);
+        }
+
+        // states from num_row are checked again before use
+        void invalidateHighlight(int num_row) {
+            this->hl_valid_rows = min(this->hl_valid_rows, num_row);
+        }
+
+        inline unsigned char startState(int num_row) {
+            return (num_row > 0) ? this->rows_state[num_row - 1].end : 0;
+        }
+
+        // state of num_row (rows before it checked) still holds, extends checked rows
+        bool checkState(int num_row) {
+            if (num_row < this->hl_valid_rows) {
+                return true;
+            }
+
+            const LineState &state = this->rows_state[num_row];
+
+            if (!state.lexed || state.start != this->startState(num_row)) {
+                return false;
+            }
+
+            this->hl_valid_rows = num_row + 1;
+            return true;
+        }
+
+        // check states of rows before num_row, lex rows whose start state changed (not rendered)
+        // false if too many rows are left, they are lexed on highlight thread then
+        bool updateHighlightState(int num_row) {
+            string scratch = "";
+
+            if (num_row - this->hl_valid_rows > Mim::highlight_budget) {
+                this->requestHighlight(num_row);
+                return false;
+            }
+
+            while (this->hl_valid_rows < num_row) {
+                int idx = this->hl_valid_rows;
+
+                if (this->checkState(idx)) {
+                    continue;
+                }
+
+                unsigned char start = this->startState(idx);
+                size_t begin = this->text.lineOffset(idx);
+                size_t length = this->text.lineLength(idx);
+                const char *raw = this->text.span(begin, begin + length, scratch);
+                this->rows_state[idx] = LineState(start, this->grammar->scan(raw, length, start));
+                this->rows_cache.erase(idx);    // drawn with old state
+                ++this->hl_valid_rows;
+            }
+
+            return true;
+        }
+
+        // lex rows up to num_row (and a screen beyond) on highlight thread, rows around them are rendered too
+        void requestHighlight(int num_row) {
+            if (this->highlight_version == this->text.getVersion() && num_row < this->highlight_end) {
+                return;
+            }
+
+            int window = this->config.screen_rows + this->config.prefetch_rows;
+            int end = min(max(num_row + 1, this->row_off) + window, this->num_rows);
+
+            if (!this->highlight_thread.joinable()) {
+                if (pipe(this->highlight_pipe) == -1) {
+                    throw MimError("Create highlight pipe failed.");
+                }
+
+                for (int i = 0; i < 2; ++i) {
+                    fcntl(this->highlight_pipe[i], F_SETFL, fcntl(this->highlight_pipe[i], F_GETFL) | O_NONBLOCK);
+                    fcntl(this->highlight_pipe[i], F_SETFD, FD_CLOEXEC);
+                }
+
+                this->highlight_thread = thread(&Mim::highlightLoop, this);
+            }
+
+            lock_guard<mutex> guard(this->highlight_lock);
+            ++this->highlight_generation;
+            this->highlight_job.text = this->text.snapshot();
+            this->highlight_job.grammar = this->grammar;
+            this->highlight_job.from = this->hl_valid_rows;
+            this->highlight_job.state = this->startState(this->hl_valid_rows);
+            this->highlight_job.show_begin = max(this->hl_valid_rows, end - 2 * window);
+            this->highlight_job.end = end;
+            this->highlight_queued = true;
+            this->highlight_ready = false;
+            this->highlight_version = this->text.getVersion();
+            this->highlight_end = end;
+            this->highlight_cond.notify_all();
+        }
+
+        // drop queued job and wait for running one, text may be unmapped after return
+        void cancelHighlight(void) {
+            unique_lock<mutex> guard(this->highlight_lock);
+            ++this->highlight_generation;
+            this->highlight_queued = false;
+            this->highlight_ready = false;
+            this->highlight_end = 0;
+            this->highlight_cond.wait(guard, [this] { return !this->highlight_running; });
+        }
+
+        void stopHighlight(void) {
+            if (!this->highlight_thread.joinable()) {
+                return;
+            }
+
+            {
+                lock_guard<mutex> guard(this->highlight_lock);
+                ++this->highlight_generation;
+                this->highlight_stopping = true;
+                this->highlight_cond.notify_all();
             }
 
+            this->highlight_thread.join();
+            close(this->highlight_pipe[0]);
+            close(this->highlight_pipe[1]);
+            this->highlight_pipe[0] = -1;
+            this->highlight_pipe[1] = -1;
+        }
+
+        // highlight thread: lex latest job, wake up event loop with result
+        void highlightLoop(void) {
+            unique_lock<mutex> guard(this->highlight_lock);
+
             while (true) {
-                this->updateLastlineBuffer(prompt + lastline_command);
-                this->refreshScreen();
-                this->refreshBuffer();
-                int ch = this->readKey();
+                this->highlight_cond.wait(guard, [this] { return this->highlight_stopping || this->highlight_queued; });
 
-                if (ch == '\b') {
-                    if (lastline_command.length()) {
-                        lastline_command = lastline_command.substr(0, lastline_command.length() - 1);
-                    }
-                } else if (ch == KEY_ESC) {
-                    lastline_command = "";
-                    this->cx = orig_cx ;
-                    this->cy = orig_cy ;
-                    this->col_off = orig_col_off ;
-                    this->row_off = orig_row_off ;
-                    break;
-                } else if (ch == '\r') {
-                    if (lastline_command.length()) {
-                        break;
+                if (this->highlight_stopping) {
+                    return;
+                }
+
+                HighlightJob job = this->highlight_job;
+                unsigned int generation = this->highlight_generation;
+                HighlightResult result;
+
+                this->highlight_job.text = TextSnapshot();  // do not keep old text alive
+                this->highlight_queued = false;
+                this->highlight_running = true;
+                guard.unlock();
+
+                bool done = this->lexRows(job, generation, result);
+
+                guard.lock();
+                this->highlight_running = false;
+
+                if (done && generation == this->highlight_generation) {
+                    swap(this->highlight_result, result);
+                    this->highlight_ready = true;
+
+                    if (write(this->highlight_pipe[1], "", 1) == -1) {
+                        // pipe full, a wake up is pending anyway
                     }
-                } else if (!iscntrl(ch) && ch < 128) {
-                    lastline_command.append(string(1, ch));
                 }
 
-                if (mode == Mim::LastlineMode::search) {
-                    this->searchText(lastline_command, Mim::Direction::input);
-                }
+                this->highlight_cond.notify_all();
+            }
+        }
+
+        // states of rows [from, end) of job snapshot, false if a newer job came
+        bool lexRows(const HighlightJob &job, unsigned int generation, HighlightResult &result) {
+            string scratch = "";
+            unsigned char state = job.state;
+
+            result.version = job.text.getVersion();
+            result.from = job.from;
+            result.show_begin = job.show_begin;
+            result.states.reserve(job.end - job.from);
+
+            for (int idx = job.from; idx < job.end; ++idx) {
+                if (idx % 1024 == 0 && this->highlight_generation != generation) {
+                    return false;
+                }
+
+                size_t begin = job.text.lineOffset(idx);
+                size_t length = job.text.lineLength(idx);
+                const char *raw = job.text.span(begin, begin + length, scratch);
+                unsigned char start = state;
+
+                if (idx < job.show_begin) {
+                    state = job.grammar->scan(raw, length, start);
+                } else {
+                    RowBuffer row(string(raw, length));
+                    this->raw2render(row);
+                    row.hl.assign(row.render.length(), Mim::HL::plain);
+                    state = job.grammar->highlight(row.render.data(), row.render.length(), start, &row.hl[0]);
+                    result.rows.push_back(row);
+                }
+
+                result.states.push_back(LineState(start, state));
+            }
+
+            return true;
+        }
+
+        // take states and rows of finished job, returns true if screen needs redraw
+        bool applyHighlightResult(void) {
+            HighlightResult result;
+
+            {
+                lock_guard<mutex> guard(this->highlight_lock);
+
+                if (!this->highlight_ready) {
+                    return false;
+                }
+
+                swap(result, this->highlight_result);
+                this->highlight_ready = false;
+            }
+
+            this->highlight_end = 0;
+
+            // buffer edited since snapshot
+            if (result.version != this->text.getVersion() || result.from > this->hl_valid_rows) {
+                return false;
+            }
+
+            int end = result.from + (int)result.states.size();
+
+            for (int idx = this->hl_valid_rows; idx < end; ++idx) {
+                LineState &state = this->rows_state[idx];
+                const LineState &lexed = result.states[idx - result.from];
+
+                if (!state.lexed || state.start != lexed.start) {
+                    this->rows_cache.erase(idx);    // drawn with old state
+                }
+
+                state = lexed;
+            }
+
+            this->hl_valid_rows = max(this->hl_valid_rows, end);
+
+            for (size_t i = 0; i < result.rows.size(); ++i) {
+                this->rows_cache.put(result.show_begin + i, result.rows[i]);
+            }
+
+            return true;
+        }
+
+        // every edit of text goes through these (journaled, recorded for undo)
+        void insertBytes(size_t offset, const char *str, size_t length) {
+            this->text.insert(offset, str, length);
+            this->journal.insert(offset, str, length);
+            this->undo_log.insert(offset, length);
+        }
+
+        void insertBytes(size_t offset, const string &str) {
+            this->insertBytes(offset, str.c_str(), str.length());
+        }
+
+        void eraseBytes(size_t offset, size_t length) {
+            string erased = "";
+            this->text.read(offset, offset + length, erased);
+            this->undo_log.erase(offset, erased);
+
+            this->text.erase(offset, length);
+            this->journal.erase(offset, length);
+        }
+
+        // edit by undo/redo, rows from edited one are lexed and rendered again
+        void editBytes(bool insert, size_t offset, const char *str, size_t length) {
+            int num_row = this->text.lineAt(offset);
+            int lines = count(str, str + length, '\n');
+
+            if (insert) {
+                this->text.insert(offset, str, length);
+                this->journal.insert(offset, str, length);
+                this->insertStates(num_row, lines);
+                this->num_rows += lines;
+            } else {
+                this->text.erase(offset, length);
+                this->journal.erase(offset, length);
+                this->eraseStates(num_row, lines);
+                this->num_rows -= lines;
             }
 
-            return lastline_command;
+            this->invalidateHighlight(num_row);
+            this->invalidateRows(num_row);
         }
 
-        void processLastlineCommand(const string &command) {
-            regex re_num("[0-9]+");
+        void insertRow(int num_row, const string &line) {
+            if (num_row < 0 || num_row > this->num_rows) {
+                return;
+            }
 
-            if (regex_match(command, re_num)) {
-                int jump_line = stoi(command);
-                this->keyHomeEnd(KEY_HOME);
-                this->cy = min(max(jump_line - 1, 0), this->num_rows);
-            } else {
-                if (command.find("!") != string::npos) {
-                    this->force_quit = true;
-                }
+            this->insertBytes(this->text.lineOffset(num_row), line + "\n");
+            this->insertStates(num_row, 1);
+            ++this->num_rows;
 
-                if (command.find("w") != string::npos) {
-                    this->saveToFile();
-                }
+            this->invalidateHighlight(num_row);
+            this->invalidateRows(num_row);
+            this->touchRow(num_row);
+            this->dirty_flag = true;
+        }
 
-                if (command.find("q") != string::npos) {
-                    this->closeEditor();
-                }
+        void delRow(int num_row) {
+            if (num_row < 0 || num_row >= this->num_rows) {
+                return;
             }
 
-            this->enterCommandMode();
+            this->eraseBytes(this->text.lineOffset(num_row), this->text.lineLength(num_row) + 1);
+            this->eraseStates(num_row, 1);
+            --this->num_rows;
+
+            this->invalidateHighlight(num_row);
+            this->invalidateRows(num_row);
+            this->dirty_flag = true;
         }
 
+        void appendStringToRow(int num_row, const string &str) {
+            if (num_row < 0 || num_row >= this->num_rows) {
+                return;
+            }
 
-        void processKeyPress(void) {
-            try {
-                int ch = this->readKey();
+            this->insertBytes(this->text.lineOffset(num_row) + this->text.lineLength(num_row), str);
+            this->dropSearchMatch(num_row, num_row);
+            this->touchRow(num_row);
+            this->dirty_flag = true;
+        }
 
-                switch (this->editor_mode) {
-                    case Mim::MimMode::command:
-                        this->processKeyPressInCommandMode(ch);
-                        break;
-                    case Mim::MimMode::insert:
-                        this->processKeyPressInInsertMode(ch);
-                        break;
-                    default:
-                        break;
-                }
+        void insertCharToRow(int num_row, int at, int ch) {
+            int length = this->rowLength(num_row);
 
-            } catch (const MimError &e) {
-                throw e;
+            if (at < 0 || at > length) {
+                at = length;
             }
+
+            char buf = ch;
+            this->insertBytes(this->text.lineOffset(num_row) + at, &buf, 1);
+            this->dropSearchMatch(num_row, num_row);
+            this->touchRow(num_row);
+            this->dirty_flag = true;
         }
 
-        /*** output ***/
-        inline void refreshBuffer(void) {
-            write(STDOUT_FILENO, this->screen_buffer.c_str(), this->screen_buffer.length());
-            this->screen_buffer.clear();
+        void delCharFromRow(int num_row, int at) {
+            if (at < 1 || at > this->rowLength(num_row)) {
+                return;
+            }
+
+            this->eraseBytes(this->text.lineOffset(num_row) + at - 1, 1);
+            this->dropSearchMatch(num_row, num_row);
+            this->touchRow(num_row);
+            this->dirty_flag = true;
         }
 
-        inline void scroll(void) {
-            this->rx = this->rx_base;
+        // break row at column into two rows
+        void splitRow(int num_row, int at) {
+            if (num_row < 0 || num_row >= this->num_rows) {
+                return;
+            }
 
-            // get rx from cx
-            if (this->cy < this->num_rows) {
-                this->rx = cx2rx(this->rows_buffer[this->cy].raw, this->cx);
+            at = min(max(at, 0), this->rowLength(num_row));
+            this->insertBytes(this->text.lineOffset(num_row) + at, "\n", 1);
+            this->insertStates(num_row + 1, 1);
+            ++this->num_rows;
+
+            this->invalidateHighlight(num_row);
+            this->invalidateRows(num_row);
+            this->touchRow(num_row);
+            this->touchRow(num_row + 1);
+            this->dirty_flag = true;
+        }
+
+        // insert text (may hold '\n') into row as one buffer operation
+        void insertStringToRow(int num_row, int at, const string &str) {
+            if (num_row < 0 || num_row >= this->num_rows) {
+                return;
             }
 
-            // up
-            if (this->cy < this->row_off) {
-                this->row_off = this->cy;
+            int length = this->rowLength(num_row);
+
+            if (at < 0 || at > length) {
+                at = length;
             }
 
-            // down
-            if (this->cy >= this->row_off + this->config.screen_rows) {
-                this->row_off = this->cy - this->config.screen_rows + 1;
+            int lines = count(str.begin(), str.end(), '\n');
+            this->insertBytes(this->text.lineOffset(num_row) + at, str);
+
+            if (lines) {
+                this->insertStates(num_row + 1, lines);
+                this->num_rows += lines;
+                this->invalidateRows(num_row);
             }
 
-            // left
-            if (this->rx - this->rx_base < this->col_off) {
-                this->col_off = this->rx - this->rx_base;
+            this->invalidateHighlight(num_row);
+            this->touchRow(num_row);
+            this->dirty_flag = true;
+        }
+
+        // erase bytes in [begin, end) (may span rows) as one buffer operation
+        void eraseRange(size_t begin, size_t end) {
+            if (begin >= end) {
+                return;
             }
 
-            // right
-            if (this->rx >= this->col_off + this->config.screen_cols) {
-                this->col_off = this->rx - this->config.screen_cols + 1;
+            int num_row = this->text.lineAt(begin);
+            int lines = this->text.lineAt(end) - num_row;
+            this->eraseBytes(begin, end - begin);
+
+            if (lines) {
+                this->eraseStates(num_row, lines);
+                this->num_rows -= lines;
             }
+
+            this->invalidateHighlight(num_row);
+            this->invalidateRows(num_row);
+            this->dirty_flag = true;
         }
 
-        inline void showVersion(void) {
-            string welcome_msg = "Mim Editor -- version " + this->version;
-            int padding = (this->config.screen_cols - welcome_msg.length()) / 2;
+        // insert bytes (may hold '\n') at offset as one buffer operation
+        void insertRange(size_t offset, const string &str) {
+            if (str.empty()) {
+                return;
+            }
 
-            if (padding) {
-                this->screen_buffer.append("~");
-                --padding;
+            int num_row = this->text.lineAt(offset);
+            int lines = count(str.begin(), str.end(), '\n');
+            this->insertBytes(offset, str);
+
+            if (lines) {
+                this->insertStates(num_row, lines);
+                this->num_rows += lines;
             }
 
-            while (padding--) {
-                this->screen_buffer.append(" ");
+            this->invalidateHighlight(num_row);
+            this->invalidateRows(num_row);
+            this->dirty_flag = true;
+        }
+
+        // new rows at row get fresh states (and no :g mark)
+        void insertStates(int row, int lines) {
+            this->rows_state.insert(row, lines);
+
+            if (!this->global_marks.empty()) {
+                this->global_marks.insert(this->global_marks.begin() + row, lines, 0);
             }
+        }
+
+        void eraseStates(int row, int lines) {
+            this->rows_state.erase(row, lines);
 
-            this->screen_buffer.append(welcome_msg);
+            if (!this->global_marks.empty()) {
+                this->global_marks.erase(this->global_marks.begin() + row, this->global_marks.begin() + row + lines);
+            }
         }
 
-        inline void drawLineNumber(int file_row) {
-            string file_row_string = to_string(file_row + 1);
+        // rewrite bytes from begin (old ones) as str, only bytes that differ are edited
+        void replaceText(size_t begin, const string &old, const string &str) {
+            size_t prefix = 0;
+            size_t suffix = 0;
 
-            this->screen_buffer.append("\x1b[30;47m");
+            while (prefix < old.length() && prefix < str.length() && old[prefix] == str[prefix]) {
+                ++prefix;
+            }
 
-            if (this->cy == file_row) {
-                this->screen_buffer.append("\x1b[33;40m");
+            while (suffix < old.length() - prefix && suffix < str.length() - prefix &&
+                   old[old.length() - 1 - suffix] == str[str.length() - 1 - suffix]) {
+                ++suffix;
             }
 
-            for (int length = (int)file_row_string.length(); length < (this->rx_base - 1); ++length) {
-                this->screen_buffer.append(" ");
+            if (old.length() > prefix + suffix) {
+                this->eraseBytes(begin + prefix, old.length() - prefix - suffix);
             }
 
-            this->screen_buffer.append(file_row_string);
-            this->screen_buffer.append(" ");
-            this->screen_buffer.append("\x1b[m");
+            if (str.length() > prefix + suffix) {
+                this->insertBytes(begin + prefix, str.data() + prefix, str.length() - prefix - suffix);
+            }
         }
 
-        inline void drawRows(void) {
-            for (int y = 0, rows = this->num_rows, maxrows = this->config.screen_rows; y < maxrows; ++y) {
-                int file_row = y + row_off;
+        /*** editor operations ***/
 
-                if (file_row >= rows) {
-                    // draw '~' placeholder or version
-                    if (rows == 0 && y == maxrows / 3) {
-                        this->showVersion();
-                    } else {
-                        this->screen_buffer.append("~");
-                    }
+        // revert last step (redo: last undone step) at once, cursor moves to its start
+        void undoStep(bool redo) {
+            UndoStep step;
+
+            if (!(redo ? this->undo_log.takeRedo(step) : this->undo_log.takeUndo(step))) {
+                this->updateLastlineBuffer(redo ? "Already at newest change" : "Already at oldest change");
+                return;
+            }
+
+            vector<UndoStep::Op> ops;
+            UndoStep reverted;
+            step.decode(ops);
+
+            for (vector<UndoStep::Op>::reverse_iterator it = ops.rbegin(); it != ops.rend(); ++it) {
+                if (it->insert) {
+                    string erased = "";
+                    this->text.read(it->offset, it->offset + it->length, erased);
+                    reverted.erase(it->offset, erased);
+                    this->editBytes(false, it->offset, erased.data(), it->length);
                 } else {
-                    if (this->config.set_num) {
-                        this->drawLineNumber(file_row);
-                    }
+                    reverted.insert(it->offset, it->length);
+                    this->editBytes(true, it->offset, it->data, it->length);
+                }
+            }
 
-                    // draw text data from files
-                    int length = this->rows_buffer[file_row].render.length() - this->col_off;
+            if (redo) {
+                this->undo_log.pushUndo(reverted);
+            } else {
+                this->undo_log.pushRedo(reverted);
+            }
 
-                    if (length > 0) {
-                        length = min(length, this->config.screen_cols - this->rx_base);
-                        string render_row = this->rows_buffer[file_row].render.substr(this->col_off, length);
-                        string hl = this->rows_buffer[file_row].hl.substr(this->col_off, length);
-                        int current_color = -1;
+            if (!ops.empty()) {
+                size_t offset = min(ops.front().offset, this->text.length());
+                this->cy = this->text.lineAt(offset);
+                this->cx = offset - this->text.lineOffset(this->cy);
+            }
 
-                        for (int i = 0; i < length; ++i) {
-                            if (hl[i] == Mim::HL::plain) {
-                                if (current_color != -1) {
-                                    this->screen_buffer.append("\x1b[39m");
-                                    current_color = -1;
-                                }
-                            } else {
-                                int color = this->syntax2color((Mim::HL)hl[i]);
+            this->dirty_flag = true;
+        }
 
-                                if (color != current_color) {
-                                    current_color = color;
-                                    this->screen_buffer.append("\x1b[" + to_string(color) + "m");
-                                }
-                            }
+        void insertChar(int ch) {
+            if (this->cy == this->num_rows) {
+                this->insertRow(this->cy, "");
+            }
 
-                            this->screen_buffer.append(1, render_row[i]);
-                        }
+            this->insertCharToRow(this->cy, this->cx, ch);
+            ++this->cx;
+        }
+
+        // insert pasted text at cursor, cursor moves after it
+        void insertText(const string &str) {
+            string text = "";
+            text.reserve(str.length());
+
+            // terminals send '\r' for line breaks
+            for (size_t i = 0, len = str.length(); i < len; ++i) {
+                if (str[i] == '\r') {
+                    text.append(1, '\n');
 
-                        this->screen_buffer.append("\x1b[39m");
+                    if (i + 1 < len && str[i + 1] == '\n') {
+                        ++i;
                     }
+                } else {
+                    text.append(1, str[i]);
                 }
+            }
+
+            if (text.empty()) {
+                return;
+            }
+
+            if (this->cy == this->num_rows) {
+                this->insertRow(this->cy, "");
+            }
+
+            this->insertStringToRow(this->cy, this->cx, text);
+
+            size_t last_line = text.rfind('\n');
 
-                this->clearLineAfterCursor();
-                this->screen_buffer.append("\r\n");
+            if (last_line == string::npos) {
+                this->cx += text.length();
+            } else {
+                this->cy += count(text.begin(), text.end(), '\n');
+                this->cx = text.length() - last_line - 1;
             }
         }
 
-        inline void drawStatusBar(void) {
-            string status = "";
+        void delChar(void) {
+            if (this->cx <= 0 && this->cy <= 0) {
+                return;
+            }
 
-            switch (this->editor_mode) {
-                case Mim::MimMode::command:
-                    status += "COMMAND | ";
-                    break;
-                case Mim::MimMode::insert:
-                    status += "INSERT | ";
-                    break;
-                default:
-                    break;
+            if (this->cy < 0 || this->cy > this->num_rows) {
+                return;
             }
 
-            string filename = (this->editor_filename == "") ? "[No Name]" : this->editor_filename;
-            status += (filename + " - " + to_string(this->num_rows) + " lines ");
-            string modified = (this->dirty_flag) ? "(modified)" : "";
-            status += modified;
-            int length = min((int)status.length(), this->config.screen_cols);
-            string rstatus = (to_string(this->cy + 1) + "/" + to_string(this->num_rows));
-            int rlength = min((int)rstatus.length(), this->config.screen_cols);
+            if (this->cx == this->num_rows) {
+                this->keyMoveCursor(KEY_ARROW_LEFT);
+                return;
+            }
 
-            this->screen_buffer.append("\x1b[7m");
-            this->screen_buffer.append(status.c_str(), length);
+            if (this->cx <= 0) {
+                this->keyMoveCursor(KEY_ARROW_LEFT);
+                this->appendStringToRow(this->cy, this->text.line(this->cy + 1));
+                this->delRow(this->cy + 1);
+            } else {
+                this->delCharFromRow(this->cy, this->cx);
+                --this->cx;
+            }
+        }
 
-            for (int i = length, cols = this->config.screen_cols; i < cols; ++i) {
-                if (cols - i == rlength) {
-                    this->screen_buffer.append(rstatus);
-                    break;
-                } else {
-                    this->screen_buffer.append(" ");
-                }
+        void insertNewline(void) {
+            if (this->cx == 0) {
+                this->insertRow(this->cy, "");
+            } else {
+                this->splitRow(this->cy, this->cx);
             }
 
-            this->screen_buffer.append("\x1b[m");
-            this->screen_buffer.append("\r\n");
+            this->keyHomeEnd(KEY_HOME);
+            ++this->cy;
         }
 
-        inline void updateLastlineBuffer(const string &lastline) {
-            this->lastline_buffer.clear();
-            this->lastline_buffer.append(lastline);
-            this->lastline_time = time(NULL);
+        // search and jump to match before returning (n/N)
+        void searchText(const string &target, Mim::Direction direct) {
+            this->startSearch(target, direct);
+            this->waitSearch();
+            this->applySearchResult();
         }
 
-        inline void drawLastline(void) {
-            int length = min((int)this->lastline_buffer.length(), this->config.screen_cols);
+        // queue search on search thread, cancels running one; result applied by applySearchResult
+        void startSearch(const string &target, Mim::Direction direct) {
+            this->cancelSearch();
+
+            // 'pattern' or 'pattern/'
+            size_t length = (target.length() && target.back() == '/') ? target.length() - 1 : target.length();
+
+            if (length == 0 || target.find('/') < length || !this->searcher.compile(target.substr(0, length))) {
+                this->dropSearchMatch(0, this->num_rows);
+                this->last_search_buffer = "";
+                return;
+            }
+
+            if (!this->search_thread.joinable()) {
+                if (pipe(this->search_pipe) == -1) {
+                    throw MimError("Create search pipe failed.");
+                }
+
+                for (int i = 0; i < 2; ++i) {
+                    fcntl(this->search_pipe[i], F_SETFL, fcntl(this->search_pipe[i], F_GETFL) | O_NONBLOCK);
+                    fcntl(this->search_pipe[i], F_SETFD, FD_CLOEXEC);
+                }
 
-            if (length && time(NULL) - this->lastline_time < 5) {
-                this->screen_buffer.append(this->lastline_buffer.c_str(), length);
+                this->search_thread = thread(&Mim::searchLoop, this);
             }
 
-            this->clearLineAfterCursor();
+            lock_guard<mutex> guard(this->search_lock);
+            this->search_query.text = this->text.snapshot();
+            this->search_query.target = target;
+            this->search_query.start = (direct == Mim::Direction::input) ? this->cy - 1: this->cy;
+            this->search_query.direct = (direct == Mim::Direction::input) ? Mim::Direction::forward : direct;
+            this->search_query.generation = this->search_generation;
+            this->search_busy = true;
+            this->search_cond.notify_all();
         }
 
-        inline void resetCursor(void) {
-            this->screen_buffer.append("\x1b[H");  // move cursor to line 1 column 1
+        // stop running search, buffer may be edited after return
+        void cancelSearch(void) {
+            unique_lock<mutex> guard(this->search_lock);
+            ++this->search_generation;
+            this->search_ready = false;
+            this->search_cond.wait(guard, [this] { return !this->search_busy; });
         }
 
-        inline void hideCursor(void) {
-            this->screen_buffer.append("\x1b[?25l");
+        void waitSearch(void) {
+            unique_lock<mutex> guard(this->search_lock);
+            this->search_cond.wait(guard, [this] { return !this->search_busy; });
         }
 
-        inline void showCursor(void) {
-            this->screen_buffer.append("\x1b[?25h");
-        }
+        void stopSearch(void) {
+            if (!this->search_thread.joinable()) {
+                return;
+            }
 
-        inline void moveCursorTo(int x, int y) {
-            string buf = "\x1b[" + to_string(y + 1) + ";" + to_string(x + 1) + "H";
-            this->screen_buffer.append(buf);
-        }
+            {
+                lock_guard<mutex> guard(this->search_lock);
+                ++this->search_generation;
+                this->search_stopping = true;
+                this->search_cond.notify_all();
+            }
 
-        inline void clearLineAfterCursor(void) {
-            this->screen_buffer.append("\x1b[K");
+            this->search_thread.join();
+            close(this->search_pipe[0]);
+            close(this->search_pipe[1]);
+            this->search_pipe[0] = -1;
+            this->search_pipe[1] = -1;
         }
 
-        inline void clearScreen(void) {
-            this->screen_buffer.append("\x1b[2J"); // clear whole screen
-            this->resetCursor();
-        }
+        // search thread: run latest query, wake up event loop with result
+        void searchLoop(void) {
+            unique_lock<mutex> guard(this->search_lock);
 
-        inline void refreshScreen(void) {
-            this->updateCursorBase();
-            this->scroll();
-            this->hideCursor();
-            this->resetCursor();
-            this->drawRows();
-            this->drawStatusBar();
-            this->drawLastline();
-            this->moveCursorTo(this->rx - this->col_off, this->cy - this->row_off);
-            this->showCursor();
-        }
+            while (true) {
+                this->search_cond.wait(guard, [this] { return this->search_stopping || this->search_busy; });
+
+                if (this->search_stopping) {
+                    return;
+                }
+
+                SearchQuery query = this->search_query;
+                SearchResult result;
+
+                this->search_query.text = TextSnapshot();   // do not keep old text alive
+                guard.unlock();
 
-        /*** translation ***/
-        int cx2rx(const string &raw, int cx) {
-            int rx = 0;
+                result.target = query.target;
+                result.generation = query.generation;
+                result.index = 0;
+                result.total = 0;
+                result.found = this->findMatch(query, result.row, result.pos, result.len);
 
-            for (int i = 0; i < cx; ++i) {
-                if (raw[i] == '\t') {
-                    rx += ((this->config.tabs_width - 1) - (rx % this->config.tabs_width));
+                if (result.found && this->config.search_count) {
+                    this->countMatches(query, result.row, result.pos, result.index, result.total);
                 }
 
-                ++rx;
-            }
+                guard.lock();
 
-            // prevent space calculation from rx_base
-            rx += this->rx_base;
+                if (query.generation == this->search_generation) {
+                    this->search_result = result;
+                    this->search_ready = true;
 
-            return rx;
+                    if (write(this->search_pipe[1], "", 1) == -1) {
+                        // pipe full, a wake up is pending anyway
+                    }
+                }
+
+                this->search_busy = false;
+                this->search_cond.notify_all();
+            }
         }
 
-        int rx2cx(const string &raw, int rx) {
-            int cur_rx = 0;
-            int cx = 0;
-            int len = (int)raw.length();
+        // jump to match of finished search, returns true if anything changed
+        bool applySearchResult(void) {
+            SearchResult result;
 
-            // prevent space calculation from rx_base
-            // rx -= this->rx_base;
+            {
+                lock_guard<mutex> guard(this->search_lock);
 
-            while (cx < len) {
-                if (raw[cx] == '\t') {
-                    cur_rx += ((this->config.tabs_width - 1) - (cur_rx % this->config.tabs_width));
+                if (!this->search_ready || this->search_result.generation != this->search_generation) {
+                    return false;
                 }
 
-                ++cur_rx;
+                result = this->search_result;
+                this->search_ready = false;
+            }
 
-                if (cur_rx > rx) {
-                    return cx;
-                }
+            this->dropSearchMatch(0, this->num_rows);
 
-                ++cx;
+            // row of searched snapshot may be gone from buffer
+            if (!result.found || result.row >= this->num_rows) {
+                return true;
             }
 
-            return cx;
-        }
+            const RowBuffer &row = this->getRow(result.row);
 
-        int syntax2color(Mim::HL hl) {
-            // syntax theme config
-            switch (hl) {
-                case Mim::HL::comment:
-                case Mim::HL::mlcomment:
-                    return 36;
-                case Mim::HL::keyword_type:
-                    return 31;
-                case Mim::HL::keyword_statement:
-                    return 32;
-                case Mim::HL::str:
-                    return 35;
-                case Mim::HL::number:
-                    return 33;
-                case Mim::HL::match:
-                    return 34;
-                default:
-                    return 37;
-            }
+            this->last_search_row = result.row;
+            this->last_search_buffer = result.target;
+            this->last_search_rx = this->cx2rx(row, result.pos) - this->rx_base;
+            this->last_search_rlen = this->cx2rx(row, result.pos + result.len) - this->rx_base - this->last_search_rx;
+            this->last_search_index = result.index;
+            this->last_search_total = result.total;
+
+            this->cy = result.row;
+            this->cx = result.pos;
+            this->row_off = this->num_rows;
+            return true;
         }
 
-        bool isSeparator(int ch) {
-            return isspace(ch) || ch == '\0' || strchr(",.()+-/*=~%<>[];{}", ch) != NULL;
+        // rows per search task, small buffers stay on one thread
+        int searchChunk(int rows) {
+            return max(4096, rows / (this->search_pool.size() * 8) + 1);
         }
 
-        const string raw2render(const string &raw) {
-            string render = "";
+        // nearest match after row start in direction (wraps around), rows split across workers
+        bool findMatch(const SearchQuery &query, int &row, size_t &pos, size_t &len) {
+            struct Found {
+                int distance;   // 0 for no match in task
+                size_t pos;
+                size_t len;
+            };
+
+            const TextSnapshot &text = query.text;
+            int rows = text.lines();
+            int chunk = this->searchChunk(rows);
+            int tasks = (rows + chunk - 1) / chunk;
+            int start = query.start;
+            int direct = query.direct;
+            unsigned int generation = query.generation;
+            vector<Found> found(tasks, Found{0, 0, 0});
+            atomic<int> nearest(rows + 1);
+
+            // task i scans distances (i * chunk, (i + 1) * chunk], nearer tasks are taken first
+            this->search_pool.run(tasks, [&](int task) {
+                string scratch = "";
+
+                for (int d = task * chunk + 1, last = min((task + 1) * chunk, rows); d <= last; ++d) {
+                    if (d >= nearest.load(memory_order_relaxed) || this->search_generation != generation) {
+                        return;
+                    }
+
+                    int current = ((start + direct * d) % rows + rows) % rows;
+                    size_t begin = text.lineOffset(current);
+                    size_t end = begin + text.lineLength(current);
+                    const char *raw = text.span(begin, end, scratch);
+                    Found &f = found[task];
+
+                    if (this->searcher.find(raw, raw + (end - begin), f.pos, f.len)) {
+                        f.distance = d;
+                        int best = nearest.load();
 
-            for (int i = 0, len = (int)raw.length(); i < len; ++i) {
-                if (raw[i] == '\t') {
-                    render.append(" ");
+                        while (d < best && !nearest.compare_exchange_weak(best, d)) {
+                        }
 
-                    while (render.length() % (this->config.tabs_width) != 0) {
-                        render.append(" ");
+                        return;
                     }
-                } else {
-                    render.append(1, raw[i]);
                 }
+            });
+
+            const Found *best = NULL;
+
+            for (size_t i = 0; i < found.size(); ++i) {
+                if (found[i].distance && (best == NULL || found[i].distance < best->distance)) {
+                    best = &found[i];
+                }
+            }
+
+            if (best == NULL || this->search_generation != generation) {
+                return false;
             }
 
-            return render;
+            row = ((start + direct * best->distance) % rows + rows) % rows;
+            pos = best->pos;
+            len = best->len;
+            return true;
         }
 
-        const string render2hl(const string &render, int idx) {
-            string hl = "";
-            bool prev_sep = true;
-            bool in_comment = (idx > 0 && this->rows_buffer[idx - 1].hl_open_comment);
-            int in_string = 0;
-
-            for (int i = 0, len = (int)render.length(); i < len; ++i) {
-                char ch = render[i];
-                char prev_hl = (i > 0) ? hl[i - 1] : (char)Mim::HL::plain;
-
-                if (!in_string && !in_comment) {
-                    if (render.substr(i, 2) == "//") {
-                        hl += string(len - i, Mim::HL::comment);
-                        break;
+        // rank of the match at (row, pos) among all matches of the buffer
+        void countMatches(const SearchQuery &query, int row, size_t pos, size_t &index, size_t &total_matches) {
+            const TextSnapshot &text = query.text;
+            int rows = text.lines();
+            int chunk = this->searchChunk(rows);
+            int tasks = (rows + chunk - 1) / chunk;
+            unsigned int generation = query.generation;
+            atomic<size_t> before(0);
+            atomic<size_t> total(0);
+
+            this->search_pool.run(tasks, [&](int task) {
+                string scratch = "";
+                size_t task_before = 0;
+                size_t task_total = 0;
+
+                for (int current = task * chunk, last = min((task + 1) * chunk, rows); current < last; ++current) {
+                    if (this->search_generation != generation) {
+                        return;
                     }
-                }
 
-                if (!in_string) {
-                    if (in_comment) {
-                        hl += Mim::HL::mlcomment;
+                    size_t begin = text.lineOffset(current);
+                    size_t end = begin + text.lineLength(current);
+                    const char *raw = text.span(begin, end, scratch);
+                    size_t matches = this->searcher.count(raw, raw + (end - begin), string::npos);
 
-                        if (render.substr(i, 2) == "*/") {
-                            hl += Mim::HL::mlcomment;
-                            in_comment = false;
-                            prev_sep = true;
-                            ++i;
-                        }
+                    task_total += matches;
 
-                        continue;
-                    } else if (render.substr(i, 2) == "/*") {
-                        hl += string(2, Mim::HL::mlcomment);
-                        in_comment = true;
-                        ++i;
-                        continue;
+                    if (current < row) {
+                        task_before += matches;
+                    } else if (current == row) {
+                        task_before += this->searcher.count(raw, raw + (end - begin), pos);
                     }
                 }
 
-                if (in_string) {
-                    hl += Mim::HL::str;
-
-                    if (ch == '\\' && (i + 1) < len) {
-                        hl += Mim::HL::str;
-                        ++i;
-                    } else {
-                        if (ch == in_string) {
-                            in_string = 0;
-                        }
+                before += task_before;
+                total += task_total;
+            });
 
-                        prev_sep = true;
-                    }
-                } else if (ch == '"' || ch == '\'') {
-                    hl += Mim::HL::str;
-                    in_string = ch;
-                } else if ((isdigit(ch) && (prev_sep || prev_hl == Mim::HL::number))
-                        || (ch == '.' && prev_hl == Mim::HL::number)) {
-                    hl += Mim::HL::number;
-                    prev_sep = false;
-                } else if (prev_sep) {
-                    bool is_keyword = false;
-
-                    for (int j = 0, size = (int)this->keywords_type.size(); j < size; ++j) {
-                        int len = (int)this->keywords_type[j].length();
-
-                        if (render.substr(i, len) == this->keywords_type[j]
-                                && this->isSeparator(render[i + len])) {
-                            is_keyword = true;
-                            hl += string(len, Mim::HL::keyword_type);
-                            i += (len - 1);
-                            break;
-                        }
-                    }
+            index = before + 1;
+            total_matches = total;
+        }
 
-                    if (!is_keyword) {
-                        for (int j = 0, size = (int)this->keywords_statement.size(); j < size; ++j) {
-                            int len = (int)this->keywords_statement[j].length();
+        // match highlight goes stale once its row is edited or shifted
+        void dropSearchMatch(int first_row, int last_row) {
+            if (this->last_search_row >= first_row && this->last_search_row <= last_row) {
+                this->last_search_rlen = 0;
+            }
+        }
 
-                            if (render.substr(i, len) == this->keywords_statement[j]
-                                    && this->isSeparator(render[i + len])) {
-                                is_keyword = true;
-                                hl += string(len, Mim::HL::keyword_statement);
-                                i += (len - 1);
-                                break;
-                            }
-                        }
-                    }
+        /*** files ***/
+        // write iovecs with writev, retries partial writes, false on error
+        bool writeBatch(int fd, vector<struct iovec> &batch, size_t &written) {
+            size_t i = 0;
 
-                    if (is_keyword) {
-                        prev_sep = false;
-                    } else {
-                        if (this->isSeparator(ch)){
-                            hl += Mim::HL::comment;
-                        } else {
-                            hl += Mim::HL::plain;
-                        }
+            while (i < batch.size()) {
+                ssize_t n = writev(fd, &batch[i], min(batch.size() - i, (size_t)IOV_MAX));
 
-                        prev_sep = this->isSeparator(ch);
-                    }
-                } else {
-                    if (this->isSeparator(ch)){
-                        hl += Mim::HL::comment;
-                    } else {
-                        hl += Mim::HL::plain;
+                if (n == -1) {
+                    if (errno == EINTR) {
+                        continue;
                     }
 
-                    prev_sep = this->isSeparator(ch);
+                    return false;
                 }
-            }
-
-            int changed = (this->rows_buffer[idx].hl_open_comment != in_comment);
-            this->rows_buffer[idx].hl_open_comment = in_comment;
 
-            if (changed && (idx + 1) < this->num_rows) {
-                this->rows_buffer[idx + 1].hl = this->render2hl(this->rows_buffer[idx + 1].render, idx + 1);
-            }
+                written += n;
 
-            return hl;
-        }
+                while (i < batch.size() && (size_t)n >= batch[i].iov_len) {
+                    n -= batch[i].iov_len;
+                    ++i;
+                }
 
-        /*** row operations ***/
-        void insertRow(int num_row, const string &line) {
-            if (num_row < 0 || num_row > this->num_rows) {
-                return;
+                if (n > 0) {
+                    batch[i].iov_base = (char *)batch[i].iov_base + n;
+                    batch[i].iov_len -= n;
+                }
             }
 
-            this->rows_buffer.insert(this->rows_buffer.begin() + num_row, RowBuffer(line));
-            this->rows_buffer[num_row].render = this->raw2render(line);
-            ++this->num_rows;
-            this->rows_buffer[num_row].hl = this->render2hl(this->rows_buffer[num_row].render, num_row);
-            this->dirty_flag = true;
+            batch.clear();
+            return true;
         }
 
-        void delRow(int num_row) {
-            if (num_row < 0 || num_row >= this->num_rows) {
-                return;
-            }
+        // stream pieces of text to fd (no copy of whole buffer), false on error
+        bool writeText(const TextSnapshot &text, int fd, size_t &written) {
+            vector<struct iovec> batch;
+            size_t batch_bytes = 0;
+            size_t chunk = Mim::save_chunk;
+            bool ok = true;
+
+            written = 0;
+            batch.reserve(IOV_MAX);
+
+            text.forEachPiece([&](const Piece &piece) {
+                // large pieces (mapped file) are written in chunks to report progress
+                for (size_t offset = 0; ok && offset < piece.length; offset += chunk) {
+                    struct iovec iov;
+                    iov.iov_base = (void *)(piece.data + offset);
+                    iov.iov_len = min(piece.length - offset, chunk);
+                    batch.push_back(iov);
+                    batch_bytes += iov.iov_len;
+
+                    if (batch.size() == IOV_MAX || batch_bytes >= 8 * chunk) {
+                        ok = this->writeBatch(fd, batch, written);
+                        batch_bytes = 0;
+                        this->save_written = written;
+                    }
+                }
+            });
 
-            this->rows_buffer.erase(this->rows_buffer.begin() + num_row);
-            --this->num_rows;
-            this->dirty_flag = true;
+            return ok && this->writeBatch(fd, batch, written);
         }
 
-        void appendStringToRow(int num_row, const string &str) {
-            this->rows_buffer[num_row].raw.append(str);
-            this->rows_buffer[num_row].render = this->raw2render(this->rows_buffer[num_row].raw);
-            this->rows_buffer[num_row].hl = this->render2hl(this->rows_buffer[num_row].render, num_row);
-            this->dirty_flag = true;
-        }
+        // map file into text buffer, rows are rendered when drawn
+        void loadFile(const char *filename) {
+            int fd = ::open(filename, O_RDONLY);
 
-        void insertCharToRow(int num_row, int at, int ch) {
-            RowBuffer row = this->rows_buffer[num_row];
+            if (fd == -1 && errno == ENOENT) {
+                fd = ::open(filename, O_RDWR | O_CREAT, 0644);
+            }
 
-            if (at < 0 || at > (int)row.raw.length()) {
-                at = row.raw.length();
+            if (fd == -1) {
+                throw MimError("Open file failed.");
             }
 
-            row.raw = row.raw.substr(0, at) + string(1, ch) + row.raw.substr(at);
-            row.render = this->raw2render(row.raw);
-            this->rows_buffer[num_row] = row;
-            row.hl = this->render2hl(row.render, num_row);
-            this->dirty_flag = true;
+            try {
+                this->text.load(fd);
+            } catch (const MimError &e) {
+                close(fd);
+                throw e;
+            }
+
+            close(fd);
         }
 
-        void delCharFromRow(int num_row, int at) {
-            RowBuffer row = this->rows_buffer[num_row];
+        // journal next to file (through symlinks), for file as on disk now
+        void attachJournal(const string &filename) {
+            struct stat st;
 
-            if (at < 1 || at > (int)row.raw.length()) {
+            // scripted edits are not recovered
+            if (this->headless) {
                 return;
             }
 
-            string left = row.raw.substr(0, at - 1);
-            string right = (at < (int)row.raw.length()) ? row.raw.substr(at) : "";
-            row.raw = left + right;
-            row.render = this->raw2render(row.raw);
-            this->rows_buffer[num_row] = row;
-            row.hl = this->render2hl(row.render, num_row);
-            this->dirty_flag = true;
+            char *real = realpath(filename.c_str(), NULL);
+            string target = (real != NULL) ? string(real) : filename;
+            free(real);
+
+            if (stat(target.c_str(), &st) == 0) {
+                this->journal.attach(Journal::pathOf(target), st);
+            }
         }
 
-        /*** editor operations ***/
+        void openFile(const char *filename) {
+            this->loadFile(filename);
+            this->editor_filename = string(filename);
 
-        void insertChar(int ch) {
-            if (this->cy == this->num_rows) {
-                this->insertRow(this->cy, "");
+            // edits of a session that did not end cleanly
+            this->attachJournal(this->editor_filename);
+            long recovered = this->journal.replay(this->text);
+
+            if (recovered > 0) {
+                this->updateLastlineBuffer("Recovered " + to_string(recovered) + " edits from journal");
+            } else if (recovered == -1) {
+                this->updateLastlineBuffer("[WARN] Journal is for another version of file, ignored");
             }
 
-            this->insertCharToRow(this->cy, this->cx, ch);
-            ++this->cx;
+            this->num_rows = this->text.lines();
+
+            string head = "";
+            size_t head_length = min(this->text.length(), (size_t)256);
+            this->grammar = findGrammar(this->editor_filename, this->text.span(0, head_length, head), head_length);
+
+            this->rows_cache.clear();
+            this->rows_state.assign(this->num_rows);
+            this->hl_valid_rows = 0;
+            this->dirty_flag = (recovered > 0);
         }
 
-        void delChar(void) {
-            if (this->cx <= 0 && this->cy <= 0) {
+        // write snapshot of text on save thread, editing goes on meanwhile
+        void saveToFile(void) {
+            if (this->save_pending) {
+                this->updateLastlineError("Save in progress");
                 return;
             }
 
-            if (this->cy < 0 || this->cy > this->num_rows) {
+            if (this->dirty_flag == false) {
+                this->updateLastlineBuffer("No bytes written to disk");
                 return;
             }
 
-            if (this->cx == this->num_rows) {
-                this->keyMoveCursor(KEY_ARROW_LEFT);
-                return;
+            if (this->editor_filename == "") {
+                this->editor_filename = this->getLastlineFromInput(Mim::LastlineMode::save);
+
+                if (this->editor_filename == "") {
+                    this->updateLastlineError("Save aborted");
+                    return;
+                }
             }
 
-            if (this->cx <= 0) {
-                this->keyMoveCursor(KEY_ARROW_LEFT);
-                this->appendStringToRow(this->cy, this->rows_buffer[this->cy + 1].raw);
-                this->delRow(this->cy + 1);
-            } else {
-                this->delCharFromRow(this->cy, this->cx);
-                --this->cx;
+            char *real = realpath(this->editor_filename.c_str(), NULL);    // through symlinks
+            string target = (real != NULL) ? string(real) : this->editor_filename;
+            free(real);
+
+            // mode of new file
+            mode_t mask = umask(0);
+            umask(mask);
+
+            if (!this->save_thread.joinable()) {
+                if (pipe(this->save_pipe) == -1) {
+                    throw MimError("Create save pipe failed.");
+                }
+
+                for (int i = 0; i < 2; ++i) {
+                    fcntl(this->save_pipe[i], F_SETFL, fcntl(this->save_pipe[i], F_GETFL) | O_NONBLOCK);
+                    fcntl(this->save_pipe[i], F_SETFD, FD_CLOEXEC);
+                }
+
+                this->save_thread = thread(&Mim::saveLoop, this);
             }
+
+            lock_guard<mutex> guard(this->save_lock);
+            this->save_job.text = this->text.snapshot();
+            this->save_job.filename = this->editor_filename;
+            this->save_job.target = target;
+            this->save_job.mode = 0666 & ~mask;
+            this->save_written = 0;
+            this->save_total = this->text.length();
+            this->save_journal_mark = this->journal.position();
+            this->save_queued = true;
+            this->save_pending = true;
+            this->save_cond.notify_all();
         }
 
-        void insertNewline(void) {
-            if (this->cx == 0) {
-                this->insertRow(this->cy, "");
-            } else {
-                string row_string = this->rows_buffer[this->cy].raw;
-                this->rows_buffer[this->cy].raw = row_string.substr(0, this->cx);
-                this->rows_buffer[this->cy].render = this->raw2render(this->rows_buffer[this->cy].raw);
+        void waitSave(void) {
+            unique_lock<mutex> guard(this->save_lock);
+            this->save_cond.wait(guard, [this] { return !this->save_queued && !this->save_running; });
+        }
 
-                string right_string = row_string.substr(this->cx);
-                this->insertRow(this->cy + 1, right_string);
+        // finishes queued save before returning
+        void stopSave(void) {
+            if (!this->save_thread.joinable()) {
+                return;
+            }
 
-                this->rows_buffer[this->cy].hl = this->render2hl(this->rows_buffer[this->cy].render, this->cy);
+            {
+                lock_guard<mutex> guard(this->save_lock);
+                this->save_stopping = true;
+                this->save_cond.notify_all();
             }
 
-            this->keyHomeEnd(KEY_HOME);
-            ++this->cy;
+            this->save_thread.join();
+            close(this->save_pipe[0]);
+            close(this->save_pipe[1]);
+            this->save_pipe[0] = -1;
+            this->save_pipe[1] = -1;
         }
 
-        void searchText(string target, Mim::Direction direct) {
-            smatch sm;
-            regex re_search("([^\\/]+)(\\/?)");
+        // save thread: write queued snapshot, wake up event loop with result
+        void saveLoop(void) {
+            unique_lock<mutex> guard(this->save_lock);
 
-            if (this->last_search_hl != "") {
-                this->rows_buffer[this->last_search_row].hl = this->last_search_hl;
-                this->last_search_hl = "";
-            }
+            while (true) {
+                this->save_cond.wait(guard, [this] { return this->save_stopping || this->save_queued; });
+
+                if (!this->save_queued) {
+                    return;
+                }
 
-            if (regex_match(target, sm, re_search)) {
-                // sm[1] for regular expression to search
-                // sm[2] for '/flags'
-                int current = (direct == Mim::Direction::input) ? this->cy - 1: this->cy;
-                direct = (direct == Mim::Direction::input) ? Mim::Direction::forward : direct;
+                SaveJob job = this->save_job;
+                SaveResult result;
 
-                for (int i = 0; i < this->num_rows; ++i) {
-                    current += direct;
+                this->save_job.text = TextSnapshot();   // do not keep old text alive
+                this->save_queued = false;
+                this->save_running = true;
+                guard.unlock();
 
-                    if (current == -1) {
-                        current = this->num_rows - 1;
-                    } else if (current == this->num_rows) {
-                        current = 0;
-                    }
+                struct timespec begin, end;
+                clock_gettime(CLOCK_MONOTONIC, &begin);
 
-                    RowBuffer row_buffer = this->rows_buffer[current];
-                    regex reg_target(sm.str(1));
-                    smatch sm_target;
+                result.version = job.text.getVersion();
+                result.filename = job.filename;
+                result.target = job.target;
+                result.written = 0;
+                result.ok = this->writeFile(job, result.written);
 
-                    if (regex_search(row_buffer.render, sm_target, reg_target)) {
-                        this->last_search_row = current;
-                        this->last_search_buffer = target;
-                        this->last_search_hl = this->rows_buffer[current].hl;
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                result.ms = (end.tv_sec - begin.tv_sec) * 1000 + (end.tv_nsec - begin.tv_nsec) / 1000000;
 
-                        this->cy = current;
-                        this->cx = rx2cx(row_buffer.raw, sm_target.position(0));
-                        this->row_off = this->num_rows;
+                // mapping and newline scan of large file stay off the UI thread
+                result.loaded = result.ok && Mim::mapSaved(result.target, job.text.length(), result.saved);
 
-                        this->rows_buffer[current].hl = this->rows_buffer[current].hl
-                            .replace(sm_target.position(0), sm_target.length(0), sm_target.length(0), Mim::HL::match);
-                        break;
-                    }
+                guard.lock();
+                this->save_running = false;
+                this->save_result = result;
+                this->save_ready = true;
+
+                if (write(this->save_pipe[1], "", 1) == -1) {
+                    // pipe full, a wake up is pending anyway
                 }
-            } else {
-                this->last_search_buffer = "";
+
+                this->save_cond.notify_all();
             }
         }
 
-        /*** files ***/
-        const string rowsBufferToString(int &ret_len) {
-            string ret_string = "";
-            ret_len = 0;
+        // map saved file into text, false if it cannot be read or is not length bytes (changed meanwhile)
+        static bool mapSaved(const string &target, size_t length, PieceTable &text) {
+            int fd = ::open(target.c_str(), O_RDONLY | O_CLOEXEC);
+            bool ok = true;
+
+            if (fd == -1) {
+                return false;
+            }
 
-            for (int i = 0, rows = this->num_rows; i < rows; ++i) {
-                string row = this->rows_buffer[i].raw;
-                ret_len += (row.length() + 1);
-                ret_string += (row + "\n");
+            try {
+                text.load(fd);
+            } catch (const MimError &e) {
+                ok = false;
             }
 
-            return ret_string;
+            close(fd);
+            return ok && text.length() == length;
         }
 
-        void openFile(const char *filename) {
-            fstream fs;
-            fs.open(filename, fstream::in | fstream::out);
+        // write temp file next to target and rename it over, target is intact until rename
+        bool writeFile(const SaveJob &job, size_t &written) {
+            size_t slash = job.target.rfind('/');
+            string dir = (slash == string::npos) ? "." : job.target.substr(0, slash + 1);
+            string temp = ((slash == string::npos) ? "" : dir) + ".mim-save-XXXXXX";
+            int fd = mkstemp(&temp[0]);
+
+            if (fd == -1) {
+                return false;
+            }
 
-            if (!fs) {
-                fs.open(filename, fstream::in | fstream::out | fstream::trunc);
+            struct stat st;
+            mode_t mode = job.mode;
 
-                if (!fs) {
-                    throw MimError("Open file failed.");
+            if (stat(job.target.c_str(), &st) == 0) {
+                mode = st.st_mode & 07777;
+
+                if (fchown(fd, st.st_uid, st.st_gid) == -1) {
+                    // not owner, file becomes ours
                 }
             }
 
-            this->editor_filename = string(filename);
+            bool ok = fchmod(fd, mode) == 0 && this->writeText(job.text, fd, written) && fsync(fd) == 0;
+            ok = (close(fd) == 0) && ok;
+            ok = ok && rename(temp.c_str(), job.target.c_str()) == 0;
+
+            if (!ok) {
+                unlink(temp.c_str());
+                return false;
+            }
 
-            string line;
+            // make rename durable
+            int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
 
-            while (getline(fs, line)) {
-                this->insertRow(this->num_rows, line);
+            if (dir_fd != -1) {
+                fsync(dir_fd);
+                close(dir_fd);
             }
 
-            this->dirty_flag = false;
-            fs.close();
+            return true;
         }
 
-        void saveToFile(void) {
-            if (this->dirty_flag == false) {
-                this->updateLastlineBuffer("No bytes written to disk");
-                return;
-            }
+        // report finished save, returns true if anything changed
+        bool applySaveResult(void) {
+            SaveResult result;
 
-            if (this->editor_filename == "") {
-                this->editor_filename = this->getLastlineFromInput(Mim::LastlineMode::save);
+            {
+                lock_guard<mutex> guard(this->save_lock);
 
-                if (this->editor_filename == "") {
-                    this->updateLastlineBuffer("Save aborted");
-                    return;
+                if (!this->save_ready) {
+                    return false;
                 }
+
+                result = this->save_result;
+                this->save_result.saved.clear();
+                this->save_ready = false;
             }
 
-            fstream fs(this->editor_filename, fstream::in | fstream::out | fstream::trunc);
+            this->save_pending = false;
 
-            if (!fs) {
-                this->updateLastlineBuffer("Save to file " + this->editor_filename + " failed");
-                return;
+            if (!result.ok) {
+                this->updateLastlineError("Save to file " + result.filename + " failed");
+                return true;
+            }
+
+            this->updateLastlineBuffer(to_string(result.written) + " bytes written to disk in " + to_string(result.ms) + " ms");
+
+            // edits made while saving are not on disk yet
+            if (result.version == this->text.getVersion()) {
+                this->dirty_flag = false;
+
+                // saved file mapped on save thread, old mapping stays valid until snapshots using it are gone
+                if (result.loaded) {
+                    this->text.adopt(result.saved);
+                }
+
+                this->journal.remove();
+                this->attachJournal(result.target);
+            } else {
+                struct stat st;
+
+                if (stat(result.target.c_str(), &st) == 0) {
+                    this->journal.rebase(st, this->save_journal_mark);
+                }
             }
 
-            int buf_len = 0;
-            string buf_string = this->rowsBufferToString(buf_len);
-            fs.write(buf_string.c_str(), buf_len);
-            this->updateLastlineBuffer(to_string(buf_len) + " bytes written to disk");
-            this->dirty_flag = false;
-            fs.close();
+            return true;
         }
 };
 
+/*** ex commands ***/
+
+const Mim::ExCommand Mim::ex_commands[] = {
+    { "delete", 1, true, &Mim::exDelete },
+    { "move", 1, true, &Mim::exMove },
+    { "copy", 2, true, &Mim::exCopy },
+    { "t", 1, true, &Mim::exCopy },
+    { "substitute", 1, true, &Mim::exSubstitute },
+    { "global", 1, true, &Mim::exGlobal },
+    { "vglobal", 1, true, &Mim::exVglobal },
+    { "normal", 4, true, &Mim::exNormal },
+    { "!", 1, true, &Mim::exFilter },
+    { "write", 1, false, &Mim::exWrite },
+    { "wq", 2, false, &Mim::exWriteQuit },
+    { "xit", 1, false, &Mim::exWriteQuit },
+    { "quit", 1, false, &Mim::exQuit },
+    { NULL, 0, false, NULL }
+};
+
+/*** languages ***/
+
+static constexpr Keyword c_keywords[] = {
+    { "int", KEYWORD_TYPE }, { "long", KEYWORD_TYPE }, { "double", KEYWORD_TYPE }, { "float", KEYWORD_TYPE },
+    { "bool", KEYWORD_TYPE }, { "char", KEYWORD_TYPE }, { "string", KEYWORD_TYPE }, { "unsigned", KEYWORD_TYPE },
+    { "signed", KEYWORD_TYPE }, { "void", KEYWORD_TYPE },
+    { "switch", KEYWORD_STATEMENT }, { "if", KEYWORD_STATEMENT }, { "while", KEYWORD_STATEMENT }, { "for", KEYWORD_STATEMENT },
+    { "break", KEYWORD_STATEMENT }, { "continue", KEYWORD_STATEMENT }, { "return", KEYWORD_STATEMENT }, { "else", KEYWORD_STATEMENT },
+    { "struct", KEYWORD_STATEMENT }, { "union", KEYWORD_STATEMENT }, { "typedef", KEYWORD_STATEMENT }, { "static", KEYWORD_STATEMENT },
+    { "enum", KEYWORD_STATEMENT }, { "class", KEYWORD_STATEMENT }, { "case", KEYWORD_STATEMENT }, { "include", KEYWORD_STATEMENT },
+    { "#include", KEYWORD_STATEMENT }
+};
+
+// c-like sources: // and /* */ comments, "" and '' strings, numbers
+constexpr Grammar cGrammar(void) {
+    enum State { sep = 0, word, text, number, slash, line_comment, ml, ml_star, ml_end, dq, dq_esc, sq, sq_esc, str_end };
+    enum Class { other = 0, digit, dot, divide, star, dquote, squote, backslash, separator };
+
+    Grammar g("c", c_keywords, sizeof(c_keywords) / sizeof(c_keywords[0]));
+
+    g.classifyRange('0', '9', digit);
+    g.classify('.', dot);
+    g.classify('/', divide);
+    g.classify('*', star);
+    g.classify('"', dquote);
+    g.classify('\'', squote);
+    g.classify('\\', backslash);
+    g.classify(" \t\n\v\f\r,()+-=~%<>[];{}", separator);
+    g.classify('\0', separator);
+
+    g.state(sep, Mim::HL::plain, false);
+    g.state(word, Mim::HL::plain, true);
+    g.state(text, Mim::HL::plain, false);
+    g.state(number, Mim::HL::number, false);
+    g.state(slash, Mim::HL::plain, false);
+    g.state(line_comment, Mim::HL::comment, false);
+    g.state(ml, Mim::HL::mlcomment, false);
+    g.state(ml_star, Mim::HL::mlcomment, false);
+    g.state(ml_end, Mim::HL::mlcomment, false);
+    g.state(dq, Mim::HL::str, false);
+    g.state(dq_esc, Mim::HL::str, false);
+    g.state(sq, Mim::HL::str, false);
+    g.state(sq_esc, Mim::HL::str, false);
+    g.state(str_end, Mim::HL::str, false);
+
+    // between tokens
+    g.on(sep, other, word);
+    g.on(sep, backslash, word);
+    g.on(sep, digit, number);
+    g.on(sep, dot, sep);
+    g.on(sep, star, sep);
+    g.on(sep, separator, sep);
+    g.on(sep, divide, slash);
+    g.on(sep, dquote, dq);
+    g.on(sep, squote, sq);
+    g.copy(ml_end, sep);
+    g.copy(str_end, sep);
+
+    g.copy(slash, sep);
+    g.on(slash, divide, line_comment, Grammar::backfill);
+    g.on(slash, star, ml, Grammar::backfill);
+
+    g.copy(word, sep);
+    g.on(word, digit, word);
+    g.on(word, dot, sep, Grammar::word_end);
+    g.on(word, star, sep, Grammar::word_end);
+    g.on(word, separator, sep, Grammar::word_end);
+    g.on(word, divide, slash, Grammar::word_end);
+
+    g.copy(text, sep);
+    g.on(text, other, text);
+    g.on(text, backslash, text);
+    g.on(text, digit, text);
+
+    g.copy(number, sep);
+    g.on(number, dot, number);
+    g.on(number, other, text);
+    g.on(number, backslash, text);
+
+    g.all(line_comment, line_comment);
+
+    g.all(ml, ml);
+    g.on(ml, star, ml_star);
+    g.all(ml_star, ml);
+    g.on(ml_star, star, ml_star);
+    g.on(ml_star, divide, ml_end);
+    g.carry(ml, ml);
+    g.carry(ml_star, ml);
+
+    g.all(dq, dq);
+    g.on(dq, backslash, dq_esc);
+    g.on(dq, dquote, str_end);
+    g.all(dq_esc, dq);
+    g.all(sq, sq);
+    g.on(sq, backslash, sq_esc);
+    g.on(sq, squote, str_end);
+    g.all(sq_esc, sq);
+
+    g.keywordColors(Mim::HL::keyword_type, Mim::HL::keyword_statement);
+    g.finish();
+    return g;
+}
+
+static constexpr Keyword python_keywords[] = {
+    { "int", KEYWORD_TYPE }, { "float", KEYWORD_TYPE }, { "str", KEYWORD_TYPE }, { "bool", KEYWORD_TYPE },
+    { "bytes", KEYWORD_TYPE }, { "list", KEYWORD_TYPE }, { "dict", KEYWORD_TYPE }, { "set", KEYWORD_TYPE },
+    { "tuple", KEYWORD_TYPE }, { "None", KEYWORD_TYPE }, { "True", KEYWORD_TYPE }, { "False", KEYWORD_TYPE },
+    { "self", KEYWORD_TYPE },
+    { "and", KEYWORD_STATEMENT }, { "as", KEYWORD_STATEMENT }, { "assert", KEYWORD_STATEMENT }, { "break", KEYWORD_STATEMENT },
+    { "class", KEYWORD_STATEMENT }, { "continue", KEYWORD_STATEMENT }, { "def", KEYWORD_STATEMENT }, { "del", KEYWORD_STATEMENT },
+    { "elif", KEYWORD_STATEMENT }, { "else", KEYWORD_STATEMENT }, { "except", KEYWORD_STATEMENT }, { "finally", KEYWORD_STATEMENT },
+    { "for", KEYWORD_STATEMENT }, { "from", KEYWORD_STATEMENT }, { "global", KEYWORD_STATEMENT }, { "if", KEYWORD_STATEMENT },
+    { "import", KEYWORD_STATEMENT }, { "in", KEYWORD_STATEMENT }, { "is", KEYWORD_STATEMENT }, { "lambda", KEYWORD_STATEMENT },
+    { "not", KEYWORD_STATEMENT }, { "or", KEYWORD_STATEMENT }, { "pass", KEYWORD_STATEMENT }, { "raise", KEYWORD_STATEMENT },
+    { "return", KEYWORD_STATEMENT }, { "try", KEYWORD_STATEMENT }, { "while", KEYWORD_STATEMENT }, { "with", KEYWORD_STATEMENT },
+    { "yield", KEYWORD_STATEMENT }
+};
+
+// python: # comments, "" and '' strings, triple quoted strings spanning rows
+constexpr Grammar pythonGrammar(void) {
+    enum State {
+        sep = 0, word, text, number, comment, str_end,
+        dq_open, dq, dq_esc, dq_empty, tdq, tdq_esc, tdq_q1, tdq_q2,
+        sq_open, sq, sq_esc, sq_empty, tsq, tsq_esc, tsq_q1, tsq_q2
+    };
+    enum Class { other = 0, digit, dot, hash, dquote, squote, backslash, separator };
+
+    Grammar g("python", python_keywords, sizeof(python_keywords) / sizeof(python_keywords[0]));
+
+    g.classifyRange('0', '9', digit);
+    g.classify('.', dot);
+    g.classify('#', hash);
+    g.classify('"', dquote);
+    g.classify('\'', squote);
+    g.classify('\\', backslash);
+    g.classify(" \t\n\v\f\r,()+-*/=~%<>[];:{}!&|^@", separator);
+    g.classify('\0', separator);
+
+    g.state(sep, Mim::HL::plain, false);
+    g.state(word, Mim::HL::plain, true);
+    g.state(text, Mim::HL::plain, false);
+    g.state(number, Mim::HL::number, false);
+    g.state(comment, Mim::HL::comment, false);
+
+    for (int state = str_end; state <= tsq_q2; ++state) {
+        g.state(state, Mim::HL::str, false);
+    }
+
+    g.on(sep, other, word);
+    g.on(sep, backslash, word);
+    g.on(sep, digit, number);
+    g.on(sep, dot, sep);
+    g.on(sep, separator, sep);
+    g.on(sep, hash, comment);
+    g.on(sep, dquote, dq_open);
+    g.on(sep, squote, sq_open);
+    g.copy(str_end, sep);
+
+    // string prefixes (r"", b"") stay words
+    g.copy(word, sep);
+    g.on(word, digit, word);
+    g.on(word, dot, sep, Grammar::word_end);
+    g.on(word, separator, sep, Grammar::word_end);
+    g.on(word, hash, comment, Grammar::word_end);
+
+    g.copy(text, sep);
+    g.on(text, other, text);
+    g.on(text, backslash, text);
+    g.on(text, digit, text);
+
+    g.copy(number, sep);
+    g.on(number, dot, number);
+    g.on(number, other, text);
+    g.on(number, backslash, text);
+
+    g.all(comment, comment);
+
+    // "" is empty string unless third quote follows
+    g.all(dq, dq);
+    g.on(dq, backslash, dq_esc);
+    g.on(dq, dquote, str_end);
+    g.all(dq_esc, dq);
+    g.copy(dq_open, dq);
+    g.on(dq_open, dquote, dq_empty);
+    g.copy(dq_empty, sep);
+    g.on(dq_empty, dquote, tdq);
+    g.all(tdq, tdq);
+    g.on(tdq, backslash, tdq_esc);
+    g.on(tdq, dquote, tdq_q1);
+    g.all(tdq_esc, tdq);
+    g.copy(tdq_q1, tdq);
+    g.on(tdq_q1, dquote, tdq_q2);
+    g.copy(tdq_q2, tdq);
+    g.on(tdq_q2, dquote, str_end);
+
+    g.all(sq, sq);
+    g.on(sq, backslash, sq_esc);
+    g.on(sq, squote, str_end);
+    g.all(sq_esc, sq);
+    g.copy(sq_open, sq);
+    g.on(sq_open, squote, sq_empty);
+    g.copy(sq_empty, sep);
+    g.on(sq_empty, squote, tsq);
+    g.all(tsq, tsq);
+    g.on(tsq, backslash, tsq_esc);
+    g.on(tsq, squote, tsq_q1);
+    g.all(tsq_esc, tsq);
+    g.copy(tsq_q1, tsq);
+    g.on(tsq_q1, squote, tsq_q2);
+    g.copy(tsq_q2, tsq);
+    g.on(tsq_q2, squote, str_end);
+
+    for (int state = tdq; state <= tdq_q2; ++state) {
+        g.carry(state, tdq);
+    }
+
+    for (int state = tsq; state <= tsq_q2; ++state) {
+        g.carry(state, tsq);
+    }
+
+    g.keywordColors(Mim::HL::keyword_type, Mim::HL::keyword_statement);
+    g.finish();
+    return g;
+}
+
+static constexpr Keyword shell_keywords[] = {
+    { "local", KEYWORD_TYPE }, { "export", KEYWORD_TYPE }, { "readonly", KEYWORD_TYPE }, { "declare", KEYWORD_TYPE },
+    { "if", KEYWORD_STATEMENT }, { "then", KEYWORD_STATEMENT }, { "else", KEYWORD_STATEMENT }, { "elif", KEYWORD_STATEMENT },
+    { "fi", KEYWORD_STATEMENT }, { "for", KEYWORD_STATEMENT }, { "while", KEYWORD_STATEMENT }, { "until", KEYWORD_STATEMENT },
+    { "do", KEYWORD_STATEMENT }, { "done", KEYWORD_STATEMENT }, { "case", KEYWORD_STATEMENT }, { "esac", KEYWORD_STATEMENT },
+    { "in", KEYWORD_STATEMENT }, { "function", KEYWORD_STATEMENT }, { "return", KEYWORD_STATEMENT }, { "exit", KEYWORD_STATEMENT }
+};
+
+// shell scripts: # comments at start of word, "" strings with escapes, '' strings without
+constexpr Grammar shellGrammar(void) {
+    enum State { sep = 0, word, number, comment, dq, dq_esc, sq, str_end };
+    enum Class { other = 0, digit, hash, dquote, squote, backslash, separator };
+
+    Grammar g("shell", shell_keywords, sizeof(shell_keywords) / sizeof(shell_keywords[0]));
+
+    g.classifyRange('0', '9', digit);
+    g.classify('#', hash);
+    g.classify('"', dquote);
+    g.classify('\'', squote);
+    g.classify('\\', backslash);
+    g.classify(" \t\n\v\f\r;|&()<>`{}", separator);
+    g.classify('\0', separator);
+
+    g.state(sep, Mim::HL::plain, false);
+    g.state(word, Mim::HL::plain, true);
+    g.state(number, Mim::HL::number, false);
+    g.state(comment, Mim::HL::comment, false);
+    g.state(dq, Mim::HL::str, false);
+    g.state(dq_esc, Mim::HL::str, false);
+    g.state(sq, Mim::HL::str, false);
+    g.state(str_end, Mim::HL::str, false);
+
+    g.all(sep, word);
+    g.on(sep, digit, number);
+    g.on(sep, separator, sep);
+    g.on(sep, hash, comment);
+    g.on(sep, dquote, dq);
+    g.on(sep, squote, sq);
+    g.copy(str_end, sep);
+
+    // $# and a#b are not comments
+    g.copy(word, sep);
+    g.on(word, digit, word);
+    g.on(word, hash, word);
+    g.on(word, separator, sep, Grammar::word_end);
+
+    g.copy(number, word);
+    g.on(number, digit, number);
+    g.on(number, other, word);
+    g.on(number, backslash, word);
+    g.on(number, hash, word);
+    g.on(number, separator, sep);
+
+    g.all(comment, comment);
+
+    g.all(dq, dq);
+    g.on(dq, backslash, dq_esc);
+    g.on(dq, dquote, str_end);
+    g.all(dq_esc, dq);
+    g.all(sq, sq);
+    g.on(sq, squote, str_end);
+
+    g.keywordColors(Mim::HL::keyword_type, Mim::HL::keyword_statement);
+    g.finish();
+    return g;
+}
+
+static constexpr Keyword json_keywords[] = {
+    { "true", KEYWORD_TYPE }, { "false", KEYWORD_TYPE }, { "null", KEYWORD_TYPE }
+};
+
+// json: strings, numbers (sign, fraction, exponent) and literals
+constexpr Grammar jsonGrammar(void) {
+    enum State { sep = 0, word, number, dq, dq_esc, str_end };
+    enum Class { other = 0, digit, sign, exponent, dot, dquote, backslash, separator };
+
+    Grammar g("json", json_keywords, sizeof(json_keywords) / sizeof(json_keywords[0]));
+
+    g.classifyRange('0', '9', digit);
+    g.classify("+-", sign);
+    g.classify("eE", exponent);
+    g.classify('.', dot);
+    g.classify('"', dquote);
+    g.classify('\\', backslash);
+    g.classify(" \t\n\v\f\r,:[]{}", separator);
+    g.classify('\0', separator);
+
+    g.state(sep, Mim::HL::plain, false);
+    g.state(word, Mim::HL::plain, true);
+    g.state(number, Mim::HL::number, false);
+    g.state(dq, Mim::HL::str, false);
+    g.state(dq_esc, Mim::HL::str, false);
+    g.state(str_end, Mim::HL::str, false);
+
+    g.all(sep, word);
+    g.on(sep, digit, number);
+    g.on(sep, sign, number);
+    g.on(sep, separator, sep);
+    g.on(sep, dquote, dq);
+    g.copy(str_end, sep);
+
+    g.all(word, word);
+    g.on(word, separator, sep, Grammar::word_end);
+    g.on(word, dquote, dq, Grammar::word_end);
+
+    g.copy(number, word);
+    g.on(number, digit, number);
+    g.on(number, sign, number);
+    g.on(number, exponent, number);
+    g.on(number, dot, number);
+    g.on(number, separator, sep);
+    g.on(number, dquote, dq);
+
+    g.all(dq, dq);
+    g.on(dq, backslash, dq_esc);
+    g.on(dq, dquote, str_end);
+    g.all(dq_esc, dq);
+
+    g.keywordColors(Mim::HL::keyword_type, Mim::HL::keyword_type);
+    g.finish();
+    return g;
+}
+
+static constexpr Keyword log_keywords[] = {
+    { "DEBUG", KEYWORD_TYPE }, { "debug", KEYWORD_TYPE }, { "TRACE", KEYWORD_TYPE }, { "trace", KEYWORD_TYPE },
+    { "INFO", KEYWORD_TYPE }, { "info", KEYWORD_TYPE },
+    { "WARN", KEYWORD_STATEMENT }, { "warn", KEYWORD_STATEMENT }, { "WARNING", KEYWORD_STATEMENT }, { "warning", KEYWORD_STATEMENT },
+    { "ERROR", KEYWORD_STATEMENT }, { "error", KEYWORD_STATEMENT }, { "FATAL", KEYWORD_STATEMENT }, { "fatal", KEYWORD_STATEMENT }
+};
+
+// log files: levels, numbers and timestamps, quoted strings
+constexpr Grammar logGrammar(void) {
+    enum State { sep = 0, word, number, dq, dq_esc, str_end };
+    enum Class { other = 0, digit, stamp, dquote, backslash, separator };
+
+    Grammar g("log", log_keywords, sizeof(log_keywords) / sizeof(log_keywords[0]));
+
+    g.classifyRange('0', '9', digit);
+    g.classify(".:-", stamp);
+    g.classify('"', dquote);
+    g.classify('\\', backslash);
+    g.classify(" \t\n\v\f\r,;=()[]{}<>|/", separator);
+    g.classify('\0', separator);
+
+    g.state(sep, Mim::HL::plain, false);
+    g.state(word, Mim::HL::plain, true);
+    g.state(number, Mim::HL::number, false);
+    g.state(dq, Mim::HL::str, false);
+    g.state(dq_esc, Mim::HL::str, false);
+    g.state(str_end, Mim::HL::str, false);
+
+    g.all(sep, word);
+    g.on(sep, digit, number);
+    g.on(sep, stamp, sep);
+    g.on(sep, separator, sep);
+    g.on(sep, dquote, dq);
+    g.copy(str_end, sep);
+
+    // [ERROR] and level=warn are words between separators
+    g.all(word, word);
+    g.on(word, stamp, sep, Grammar::word_end);
+    g.on(word, separator, sep, Grammar::word_end);
+
+    // 2024-01-31 12:00:00.123 is one number
+    g.copy(number, sep);
+    g.on(number, digit, number);
+    g.on(number, stamp, number);
+    g.on(number, other, word);
+    g.on(number, backslash, word);
+
+    g.all(dq, dq);
+    g.on(dq, backslash, dq_esc);
+    g.on(dq, dquote, str_end);
+    g.all(dq_esc, dq);
+
+    g.keywordColors(Mim::HL::keyword_type, Mim::HL::keyword_statement);
+    g.finish();
+    return g;
+}
+
+// plain text: nothing highlighted
+constexpr Grammar textGrammar(void) {
+    Grammar g("text", NULL, 0);
+
+    g.state(0, Mim::HL::plain, false);
+    g.finish();
+    return g;
+}
+
+static constexpr Grammar c_grammar = cGrammar();
+static constexpr Grammar python_grammar = pythonGrammar();
+static constexpr Grammar shell_grammar = shellGrammar();
+static constexpr Grammar json_grammar = jsonGrammar();
+static constexpr Grammar log_grammar = logGrammar();
+static constexpr Grammar text_grammar = textGrammar();
+
+static const struct {
+    const char *extension;
+    const Grammar *grammar;
+} grammar_extensions[] = {
+    { ".c", &c_grammar }, { ".h", &c_grammar }, { ".cc", &c_grammar }, { ".cpp", &c_grammar },
+    { ".cxx", &c_grammar }, { ".hh", &c_grammar }, { ".hpp", &c_grammar }, { ".java", &c_grammar },
+    { ".js", &c_grammar }, { ".ts", &c_grammar }, { ".go", &c_grammar }, { ".rs", &c_grammar },
+    { ".py", &python_grammar }, { ".pyw", &python_grammar },
+    { ".sh", &shell_grammar }, { ".bash", &shell_grammar }, { ".zsh", &shell_grammar },
+    { ".json", &json_grammar },
+    { ".log", &log_grammar },
+    { ".txt", &text_grammar }, { ".md", &text_grammar }
+};
+
+const Grammar *findGrammar(const string &filename, const char *head, size_t length) {
+    size_t dot = filename.rfind('.');
+    size_t slash = filename.rfind('/');
+
+    if (dot != string::npos && (slash == string::npos || dot > slash)) {
+        string extension = filename.substr(dot);
+
+        for (const auto &entry : grammar_extensions) {
+            if (extension == entry.extension) {
+                return entry.grammar;
+            }
+        }
+    }
+
+    // no known extension, look at content
+    string first_line(head, length);
+    first_line = first_line.substr(0, first_line.find('\n'));
+
+    if (first_line.compare(0, 2, "#!") == 0) {
+        if (first_line.find("python") != string::npos) {
+            return &python_grammar;
+        }
+
+        if (first_line.find("sh") != string::npos) {
+            return &shell_grammar;
+        }
+    }
+
+    size_t first = first_line.find_first_not_of(" \t\r");
+
+    if (first != string::npos && (first_line[first] == '{' || first_line[first] == '[')) {
+        return &json_grammar;
+    }
+
+    return &c_grammar;
+}
+
 int main(int argc, char **argv) {
     Mim mim;
 
+    // mim -s script [file]: run ex commands of script on file, without terminal
+    bool headless = (argc >= 3 && strcmp(argv[1], "-s") == 0);
+    int file_arg = headless ? 3 : 1;
+
     try {
-        mim.init();
+        mim.init(headless);
 
-        if (argc >= 2) {
-            mim.open(argv[1]);
+        if (argc > file_arg) {
+            mim.open(argv[file_arg]);
         }
 
-        mim.start();
+        if (headless) {
+            // like ex mode, failed commands make exit status nonzero
+            return mim.runScript(argv[2]) ? 0 : 1;
+        } else {
+            mim.start();
+        }
     } catch (const MimError &e) {
-        printf("%s\r\n", e.what());
+        if (headless) {
+            fprintf(stderr, "%s\n", e.what());
+        } else {
+            printf("%s\r\n", e.what());
+        }
+
+        return 1;
     }
+
+    return 0;
 }